@@ -33,6 +33,7 @@ public:
     static const uint32_t Port = TPort;
     static const uint16_t Pin = TPin;
     static const uint32_t Clk_enable = TClkEnable;
+    static const bool Inverted = inv;
     static void set(bool set)
     {
         ((GPIO_TypeDef *)Port)->BSRR = ((set != inv) ? Pin : (Pin << 16));
@@ -6,7 +6,6 @@
 #include <mutex>
 
 // the predefined mutexts that have been created and maybe used by this lock
-extern SemaphoreHandle_t READY_Q_MUTEX;
 extern SemaphoreHandle_t TEMPERATURE_MUTEX;
 
 // locks a global mutex and releases when out of scope
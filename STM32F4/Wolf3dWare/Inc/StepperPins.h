@@ -0,0 +1,102 @@
+#pragma once
+
+/*
+    The Actuator pin policy for the STM32, each pin is the port and the BSRR words taken from a GPIOPin
+    so setting it is a single store expanded inline in the step ticker ISR.
+    The step pins are not written as each actuator steps, their words are or'd together for each port and
+    flushSteps() and flushUnsteps() write each port once a tick, so every axis on a port steps on the same edge
+*/
+#include "GPIO.h"
+
+// most ports the step pins can be on
+#ifndef STEP_PORTS
+#define STEP_PORTS 4
+#endif
+
+class StepPorts
+{
+public:
+    static uint8_t index(GPIO_TypeDef *port)
+    {
+        for (uint8_t i = 0; i < n; ++i) {
+            if(ports[i] == port) return i;
+        }
+        if(n == STEP_PORTS) {
+            // more ports than there are words for
+            __asm volatile ("bkpt #0");
+            return 0;
+        }
+        ports[n]= port;
+        return n++;
+    }
+
+    // the step and the unstep ISRs have their own words as the unstep one can interrupt the step one
+    static void step(uint8_t i, uint32_t word) { step_words[i] |= word; }
+    static void unstep(uint8_t i, uint32_t word) { unstep_words[i] |= word; }
+    static void flushSteps() { flush(step_words); }
+    static void flushUnsteps() { flush(unstep_words); }
+
+private:
+    static void flush(uint32_t *words)
+    {
+        for (uint8_t i = 0; i < n; ++i) {
+            if(words[i] != 0) {
+                ports[i]->BSRR= words[i];
+                words[i]= 0;
+            }
+        }
+    }
+
+    static GPIO_TypeDef *ports[STEP_PORTS];
+    static uint32_t step_words[STEP_PORTS];
+    static uint32_t unstep_words[STEP_PORTS];
+    static uint8_t n;
+};
+
+class StepperPins
+{
+public:
+    // NOTE must be assigned before the Actuator is used
+    template <class TStep, class TDir, class TEnb>
+    void assign()
+    {
+        step.assign<TStep>();
+        step_port= StepPorts::index(step.port);
+        dir.assign<TDir>();
+        enb.assign<TEnb>();
+    }
+
+    // the step is written by the next flush
+    void setStep(bool on) const
+    {
+        if(on) StepPorts::step(step_port, step.on_word);
+        else StepPorts::unstep(step_port, step.off_word);
+    }
+    void setDir(bool on) const { dir.set(on); }
+    void setEnable(bool on) const { enb.set(on); }
+
+    static void flushSteps() { StepPorts::flushSteps(); }
+    static void flushUnsteps() { StepPorts::flushUnsteps(); }
+    // only the EnablePins the actuators have when the steps are made into chunks log their steps
+    uint8_t takeSteps(bool *) const { return 0; }
+
+private:
+    struct Pin
+    {
+        template <class TPin>
+        void assign()
+        {
+            port= (GPIO_TypeDef *)TPin::Port;
+            on_word= TPin::Inverted ? (uint32_t)TPin::Pin << 16 : TPin::Pin;
+            off_word= TPin::Inverted ? TPin::Pin : (uint32_t)TPin::Pin << 16;
+        }
+        void set(bool on) const { port->BSRR= on ? on_word : off_word; }
+
+        GPIO_TypeDef *port;
+        uint32_t on_word;
+        uint32_t off_word;
+    };
+
+    Pin step, dir, enb;
+    uint8_t step_port;
+};
@@ -4,46 +4,158 @@
 #include <cmath>
 #include <iostream>
 
-// static instance shared by all Actuators, saves memory
-Block Actuator::current_block;
+// static pointer to the executing block shared by all Actuators, saves memory
+template <class TPins>
+const Block *ActuatorT<TPins>::current_block= nullptr;
+
+#ifdef STEP_FIXED_POINT
+// rate * steps / n, exactly as a 128 bit product would be, steps <= n so the result is no more than the rate but the
+// product itself overflows 64 bits once steps reaches 2^31
+static inline steprate_t scaleRate(steprate_t rate, uint32_t steps, uint32_t n)
+{
+    uint64_t r= rate;
+    return (r / n) * steps + (r % n) * steps / n;
+}
+#endif
 
 // Note Actuator::setCurerntBlock() must be called before this gets called
-void Actuator::move( bool direction, uint32_t steps_to_move, float ratio)
+template <class TPins>
+void ActuatorT<TPins>::move( bool direction, uint32_t steps_to_move, float ratio, bool advance)
 {
     this->steps_to_move = steps_to_move;
     // set direction pin
     this->direction = direction;
     // enable the stepper motor
     if(!enabled) enable(true);
-    // set the actual direction pin now so it has lots of time before the first step pulse
-    hal_functions[SET_DIR](direction);
+    if(shaper == nullptr) {
+        // set the actual direction pin now so it has lots of time before the first step pulse
+        dir_pin = direction;
+        pins.setDir(direction);
+    }
 
-    // need to scale by the axis ratio
-    axis_ratio = ratio;
+    // need to scale the block rates by the axis ratio, done once here so the ISR does not have to
+#ifdef STEP_FIXED_POINT
+    // ratio is steps_to_move/steps_event_count, do it in integer so it is exact
+    (void)ratio;
+    uint32_t n = current_block->steps_event_count;
+    steps_per_tick = scaleRate(current_block->initial_rate_fp, steps_to_move, n);
+    maximum_steps_per_tick = scaleRate(current_block->maximum_rate_fp, steps_to_move, n);
+    acceleration_per_tick = scaleRate(current_block->acceleration_per_tick_fp, steps_to_move, n);
+    deceleration_per_tick = scaleRate(current_block->deceleration_per_tick_fp, steps_to_move, n);
+#else
+    steps_per_tick = (current_block->initial_rate * ratio) / STEP_TICKER_FREQUENCY; // steps/sec / tick frequency to get steps per tick
+    maximum_steps_per_tick = (current_block->maximum_rate * ratio) / STEP_TICKER_FREQUENCY;
+    acceleration_per_tick = current_block->acceleration_per_tick * ratio;
+    deceleration_per_tick = current_block->deceleration_per_tick * ratio;
+#endif
 
-    next_accel_event = current_block.total_move_ticks + 1;  // Do nothing by default ( cruising/plateau )
+    next_accel_event = current_block->total_move_ticks + 1;  // Do nothing by default ( cruising/plateau )
     acceleration_change = 0;
-    if(current_block.accelerate_until != 0) { // If the next accel event is the end of accel
-        next_accel_event = current_block.accelerate_until;
-        acceleration_change = current_block.acceleration_per_tick;
+    s_curve_ramp = false;
+    if(current_block->accelerate_until != 0) { // If the next accel event is the end of accel
+        next_accel_event = current_block->accelerate_until;
+        acceleration_change = acceleration_per_tick;
+        if(current_block->s_curve) startSCurve(current_block->accelerate_step, acceleration_per_tick * current_block->accelerate_until);
 
-    }else if(current_block.decelerate_after == 0 /*&& current_block.accelerate_until == 0*/) {
+    }else if(current_block->decelerate_after == 0 /*&& current_block->accelerate_until == 0*/) {
         // we start off decelerating
-        acceleration_change = -current_block.deceleration_per_tick;
+        acceleration_change = -deceleration_per_tick;
+        if(current_block->s_curve) startSCurve(current_block->decelerate_step, -deceleration_per_tick * current_block->total_move_ticks);
 
-    }else if(current_block.decelerate_after != current_block.total_move_ticks /*&& current_block.accelerate_until == 0*/) {
+    }else if(current_block->decelerate_after != current_block->total_move_ticks /*&& current_block->accelerate_until == 0*/) {
         // If the next event is the start of decel ( don't set this if the next accel event is accel end )
-        next_accel_event = current_block.decelerate_after;
+        next_accel_event = current_block->decelerate_after;
+    }
+
+    // pressure advance for extruding moves, other moves just take up any advance left over from the last one
+    move_advance_ticks = advance ? advance_ticks : 0;
+    advancing = move_advance_ticks > 0 || advance_steps != 0;
+    advance_finishing = false;
+    exit_advance = 0;
+    if(move_advance_ticks > 0) {
+        exit_advance = lroundf(pressure_advance * current_block->exit_speed * steps_to_move / current_block->millimeters);
+        if(!direction) exit_advance = -exit_advance;
     }
 
-    acceleration_change *= axis_ratio;
-    steps_per_tick = (current_block.initial_rate * axis_ratio) / STEP_TICKER_FREQUENCY; // steps/sec / tick frequency to get steps per tick
-    counter = 0.0F;
+    counter = 0;
     step_count = 0;
+    holding= false;
+    reramping= false;
     moving= true;
 }
 
-bool Actuator::checkMaxSpeed()
+// feed hold, decelerates to a stop from the current rate at the blocks acceleration wherever it is in the move,
+// the steps that are left are kept so the move can be finished from rest later
+// Runs in ISR context
+template <class TPins>
+void ActuatorT<TPins>::hold()
+{
+    if(!moving) return;
+    float decel = current_block->acceleration * steps_to_move / (current_block->millimeters * STEP_TICKER_FREQUENCY_2);
+#ifdef STEP_FIXED_POINT
+    acceleration_change = -(steprate_t)(decel * STEPRATE_ONE);
+#else
+    acceleration_change = -decel;
+#endif
+    s_curve_ramp = false;
+    next_accel_event = 0; // ticks start at 1 so there are no more events
+    holding = true;
+    reramping = false;
+}
+
+// a feed hold carried on from the last block, which ran out before it could stop, slows down from speed (in mm/sec along
+// this block) rather than the rate the block was planned to start at
+// Runs in ISR context
+template <class TPins>
+void ActuatorT<TPins>::hold(float speed)
+{
+    if(!moving) return;
+    float rate = speed * steps_to_move / (current_block->millimeters * STEP_TICKER_FREQUENCY);
+#ifdef STEP_FIXED_POINT
+    steps_per_tick = (steprate_t)(rate * STEPRATE_ONE);
+#else
+    steps_per_tick = rate;
+#endif
+    hold();
+}
+
+// the speed override changed, ramps from the current rate to speed (in mm/sec along the block) at the blocks acceleration
+// and stays at it, the block events no longer apply. MotionControl calls it again with the exit speed when it is time to
+// slow down (or speed up) for the end of the block
+// Runs in ISR context
+template <class TPins>
+void ActuatorT<TPins>::reramp(float speed)
+{
+    if(!moving || holding) return;
+    float scale = steps_to_move / current_block->millimeters;
+    float accel = current_block->acceleration * scale / STEP_TICKER_FREQUENCY_2;
+    float target = speed * scale / STEP_TICKER_FREQUENCY;
+#ifdef STEP_FIXED_POINT
+    steprate_t a = (steprate_t)(accel * STEPRATE_ONE);
+    reramp_target = (steprate_t)(target * STEPRATE_ONE);
+#else
+    steprate_t a = accel;
+    reramp_target = target;
+#endif
+    acceleration_change = steps_per_tick < reramp_target ? a : -a;
+    s_curve_ramp = false;
+    next_accel_event = 0;
+    reramping = true;
+}
+
+// follow the S curve from the current rate, changing it by delta over the ramp
+template <class TPins>
+void ActuatorT<TPins>::startSCurve(scurve_t step, steprate_t delta)
+{
+    ramp_start_rate = steps_per_tick;
+    ramp_delta = delta;
+    s_u = 0;
+    s_step = step;
+    s_curve_ramp = true;
+}
+
+template <class TPins>
+bool ActuatorT<TPins>::checkMaxSpeed()
 {
     float step_freq= max_speed * steps_per_mm;
     if(step_freq > STEP_TICKER_FREQUENCY) {
@@ -54,7 +166,8 @@ bool Actuator::checkMaxSpeed()
 }
 
 // returns steps to given target in mm, and sets the milestone for steps
-std::tuple<bool, uint32_t> Actuator::stepsToTarget(float target)
+template <class TPins>
+std::tuple<bool, uint32_t> ActuatorT<TPins>::stepsToTarget(float target)
 {
     int32_t target_steps = lround(target * steps_per_mm);
     bool dir = (target_steps >= last_milestone_steps);
@@ -72,79 +185,293 @@ std::tuple<bool, uint32_t> Actuator::stepsToTarget(float target)
 // called by step ticker at 100KHz (or faster)
 // returns true if more steps need tro be issued, and false if the move finished
 // Runs in ISR context, so NO memory allocation allowed
-bool Actuator::tick(uint32_t current_tick, bool& stepped)
+template <class TPins>
+bool ActuatorT<TPins>::tick(uint32_t current_tick, bool& stepped)
 {
     if(!moving) return false;
 
-    steps_per_tick += acceleration_change;
+    if(advance_finishing) {
+        // the block has done all its steps, the advance is taken up to what it should be at the exit speed
+        stepped= advanceStep(exit_advance);
+        if(advance_steps == exit_advance) {
+            moving= false;
+            return false;
+        }
+        return true;
+    }
+
+    if(s_curve_ramp) {
+        // next point on the S curve, s= u³(10 - 15u + 6u²)
+        s_u += s_step;
+        if(s_u > SCURVE_ONE) s_u = SCURVE_ONE;
+#ifdef STEP_FIXED_POINT
+        // in 2.30 fixed point, the products of two 2.30 numbers fit in 64 bits and 10 - 15u + 6u² is at least 1
+        uint64_t u = s_u >> 2;
+        uint64_t u2 = (u * u) >> 30;
+        uint64_t u3 = (u2 * u) >> 30;
+        uint64_t p = (10ULL << 30) - 15 * u + 6 * u2;
+        int64_t s = (int64_t)((u3 * p) >> 30);
+        // 32.32 * 2.30
+        steps_per_tick = ramp_start_rate + ((ramp_delta * s) >> 30);
+#else
+        float s = s_u * s_u * s_u * (10.0F + s_u * (-15.0F + 6.0F * s_u));
+        steps_per_tick = ramp_start_rate + ramp_delta * s;
+#endif
+        // the curve turns back after the end of the deceleration, so if there are steps left carry on as the trapezoid would
+        if(current_tick >= current_block->total_move_ticks) s_curve_ramp = false;
+    } else {
+        steps_per_tick += acceleration_change;
+        // the re-ramp stops changing the rate when it gets to the new one
+        if(reramping && acceleration_change != 0 &&
+            (acceleration_change > 0 ? steps_per_tick >= reramp_target : steps_per_tick <= reramp_target)) {
+            steps_per_tick = reramp_target;
+            acceleration_change = 0;
+        }
+    }
 
     if(current_tick == next_accel_event) {
-        if(current_tick == current_block.accelerate_until) { // We are done accelerating, deceleration becomes 0 : plateau
+        if(current_tick == current_block->accelerate_until) { // We are done accelerating, deceleration becomes 0 : plateau
             acceleration_change = 0;
-            if(current_block.decelerate_after < current_block.total_move_ticks) {
-                next_accel_event = current_block.decelerate_after;
-                if(current_tick != current_block.decelerate_after) { // We start decelerating
-                    steps_per_tick = (axis_ratio * current_block.maximum_rate) / STEP_TICKER_FREQUENCY; // steps/sec / tick frequency to get steps per tick
-                }
+            s_curve_ramp = false;
+            // snap to the exact plateau rate so any rounding in the acceleration does not carry over into the rest of the move
+            steps_per_tick = maximum_steps_per_tick;
+            if(current_block->decelerate_after < current_block->total_move_ticks) {
+                next_accel_event = current_block->decelerate_after;
             }
         }
 
-        if(current_tick == current_block.decelerate_after) { // We start decelerating
-            acceleration_change = -current_block.deceleration_per_tick * axis_ratio;
+        if(current_tick == current_block->decelerate_after) { // We start decelerating
+            acceleration_change = -deceleration_per_tick;
+            if(current_block->s_curve) startSCurve(current_block->decelerate_step, -deceleration_per_tick * (current_block->total_move_ticks - current_block->decelerate_after));
         }
     }
 
-    // protect against rounding errors and such
-    if(steps_per_tick <= 0) {
-        counter = 1.0F; // we complete this step
+    if(holding && steps_per_tick <= 0) {
+        // stopped for the feed hold
+        moving= false;
+        stepped= false;
+        return false;
+    }
+
+    // protect against rounding errors and such, but an S curve from rest starts at a rate too small to show in fixed point
+    if(steps_per_tick <= 0 && !(s_curve_ramp && ramp_delta > 0)) {
+        counter = STEPRATE_ONE; // we complete this step
         steps_per_tick = 0;
     }
 
     counter += steps_per_tick;
 
-    if(counter >= 1.0F) { // step time
-        counter -= 1.0F;
+    if(counter >= STEPRATE_ONE) { // step time
+        counter -= STEPRATE_ONE;
         ++step_count;
 
         // std::cout << axis << " Step: " << step_count << " " <<  current_tick << "\n";
-        step();
-        stepped= true;
+        if(advancing) {
+            // the block moved on a step so the actuator is a step less ahead of it
+            advance_steps += direction ? -1 : 1;
+            stepped= advanceStep(advanceWanted());
+        }else{
+            commandStep(direction);
+            stepped= shaper == nullptr;
+        }
 
         if(step_count == steps_to_move) {
+            if(advancing && advance_steps != exit_advance) {
+                advance_finishing= true;
+                return true;
+            }
             moving= false;
             return false;
         }
 
     }else{
-        stepped= false;
+        stepped= advancing && advanceStep(advanceWanted());
+    }
+    return true;
+}
+
+// how many ticks after current_tick can be skipped because it does not step or change its acceleration in them, level is for
+// the Bresenham followers which step on 1/2^level steps. It errs on the short side, and anything it can't work out in advance
+// (S curves, pressure advance and input shaping) has to be ticked every tick so returns 0
+// Runs in ISR context
+template <class TPins>
+uint32_t ActuatorT<TPins>::getIdleTicks(uint32_t current_tick, uint8_t level) const
+{
+    if(!moving) return (shaper == nullptr || shaper->isIdle()) ? UINT32_MAX : 0;
+    if(s_curve_ramp || reramping || advancing || shaper != nullptr || steps_per_tick <= 0) return 0;
+
+    // the tick of the next accel event has to be issued
+    uint32_t n= next_accel_event > current_tick ? next_accel_event - current_tick - 1 : UINT32_MAX;
+
+    // how far it is to the next step (or sub step)
+#ifdef STEP_FIXED_POINT
+    steprate_t unit= STEPRATE_ONE >> level;
+    steprate_t rem= unit - (counter & (unit - 1));
+#else
+    steprate_t unit= 1.0F / (1 << level);
+    steprate_t rem= unit * (floorf(counter / unit) + 1) - counter;
+#endif
+
+    // the fastest it will go before then, when accelerating it will be no faster than it would be at the current rate
+    steprate_t rate= steps_per_tick;
+    if(acceleration_change > 0) {
+        rate += acceleration_change * (rem / steps_per_tick);
+    }else if(acceleration_change < 0) {
+        // when decelerating it must not get down to 0 either
+        steprate_t t= steps_per_tick / -acceleration_change;
+        if(t < (steprate_t)n + 1) n= t > 1 ? (uint32_t)t - 1 : 0;
+    }
+
+    // the step comes on the tick after these at the soonest
+    steprate_t t= rem / rate;
+    if(t < (steprate_t)n + 1) n= t > 1 ? (uint32_t)t - 1 : 0;
+    return n;
+}
+
+// runs the ramp over n ticks that getIdleTicks() said it would not step in
+// Runs in ISR context
+template <class TPins>
+void ActuatorT<TPins>::skipTicks(uint32_t n)
+{
+    if(!moving || n == 0) return;
+#ifdef STEP_FIXED_POINT
+    counter += steps_per_tick * n + acceleration_change * ((int64_t)n * (n + 1) / 2);
+#else
+    counter += steps_per_tick * n + acceleration_change * (n * (n + 1.0F) / 2);
+#endif
+    steps_per_tick += acceleration_change * n;
+}
+
+// steps an axis that follows the dominant axis in the Bresenham engine, returns true if it stepped
+// Runs in ISR context
+template <class TPins>
+bool ActuatorT<TPins>::followStep()
+{
+    ++step_count;
+    commandStep(direction);
+    return shaper == nullptr;
+}
+
+// Pressure advance, keeps the actuator ahead of the blocks position by the advance time * its current step rate
+template <class TPins>
+int32_t ActuatorT<TPins>::advanceWanted() const
+{
+#ifdef STEP_FIXED_POINT
+    int32_t want = (steps_per_tick * move_advance_ticks + STEPRATE_ONE / 2) >> 32;
+#else
+    int32_t want = steps_per_tick * move_advance_ticks + 0.5F;
+#endif
+    return direction ? want : -want;
+}
+
+// steps towards the wanted advance, so the extra steps follow the change in speed. At most one step is issued per tick,
+// if the advance is running behind it catches up on the following ticks.
+// returns true if it stepped
+// Runs in ISR context
+template <class TPins>
+bool ActuatorT<TPins>::advanceStep(int32_t want)
+{
+    int32_t error = want - advance_steps;
+    if(error == 0) return false;
+
+    bool dir = error > 0;
+    if(shaper != nullptr) {
+        // the shaper takes care of the direction pin
+        shaper->push(dir);
+        advance_steps += dir ? 1 : -1;
+        return false;
+    }
+    if(dir != dir_pin) {
+        // reverse and step on a later tick, this gives the driver the time it needs between the direction change and the step
+        dir_pin = dir;
+        pins.setDir(dir);
+        return false;
+    }
+
+    step();
+    advance_steps += dir ? 1 : -1;
+    return true;
+}
+
+// the step the step generator wants, it is taken now or goes through the input shaper
+// Runs in ISR context
+template <class TPins>
+void ActuatorT<TPins>::commandStep(bool dir)
+{
+    if(shaper != nullptr) {
+        shaper->push(dir);
+    }else{
+        step();
     }
+}
+
+// takes the step the input shaper wants this tick, a change of direction is set a tick before the step
+// Runs in ISR context
+template <class TPins>
+bool ActuatorT<TPins>::shapeStep()
+{
+    int s = shaper->tick();
+    if(s == 0) return false;
+
+    bool dir = s > 0;
+    if(dir != dir_pin) {
+        dir_pin = dir;
+        pins.setDir(dir);
+        return false;
+    }
+
+    step();
+    shaper->moved(s);
+    return true;
+}
+
+// NOTE only call when not moving and the shaper has finished
+template <class TPins>
+bool ActuatorT<TPins>::setInputShaper(InputShaper::TYPE type, float frequency, float damping)
+{
+    if(type == InputShaper::NONE) {
+        delete shaper;
+        shaper = nullptr;
+        return true;
+    }
+    InputShaper *s = shaper == nullptr ? new InputShaper : shaper;
+    if(!s->configure(type, frequency, damping, max_speed * steps_per_mm)) {
+        if(s != shaper) delete s;
+        return false;
+    }
+    shaper = s;
     return true;
 }
 
-void Actuator::enable(bool on)
+template <class TPins>
+void ActuatorT<TPins>::enable(bool on)
 {
-    hal_functions[SET_ENABLE](on);
+    pins.setEnable(on);
     enabled= on;
 }
 
-void Actuator::step()
+template <class TPins>
+void ActuatorT<TPins>::step()
 {
     // issue step pulse
-    hal_functions[SET_STEP](true);
+    pins.setStep(true);
 
     // keep track of real time position in steps
-    int dir= direction?1:-1;
+    int dir= dir_pin?1:-1;
     current_step_position += dir;
 
     stepped= true;
 }
 
-void Actuator::unstep()
+template <class TPins>
+void ActuatorT<TPins>::unstep()
 {
     // reset the step pulse if it stepped
     // currently takes about 1us from the set
     if(stepped) {
-        hal_functions[SET_STEP](false);
+        pins.setStep(false);
         stepped= false;
     }
 }
+
+template class ActuatorT<ActuatorPins>;
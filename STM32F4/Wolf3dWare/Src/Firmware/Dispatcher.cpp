@@ -2,6 +2,7 @@
 #include "Kernel.h"
 #include "GCode.h"
 #include "GCodeProcessor.h"
+#include "MotionControl.h"
 
 #include <ctype.h>
 #include <cmath>
@@ -22,6 +23,11 @@ std::string Dispatcher::dispatch(GCode& gc) const
 		gc.setCommand('M', 500, 3);
 	}
 
+	// anything other than a linear move must not run until the lines before it have been given to the planner
+	if(!(gc.hasG() && gc.getCode() <= 1)) {
+		THEKERNEL.getMotionControl().flushMoves();
+	}
+
 	auto& handler= gc.hasG() ? gcode_handlers : mcode_handlers;
 	const auto& f= handler.equal_range(gc.getCode());
 	bool ret= false;
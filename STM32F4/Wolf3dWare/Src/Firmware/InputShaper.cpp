@@ -0,0 +1,141 @@
+/**
+	The shaper impulses are the usual ZV, ZVD and MZV ones, as used by Klipper
+	https://github.com/Klipper3d/klipper/blob/master/klippy/extras/shaper_defs.py
+*/
+#include "InputShaper.h"
+#include "Block.h"
+
+#include <cmath>
+
+// the queue holds every step commanded at max_step_rate (at most one a tick) over delay ticks, the ring needs one spare
+size_t InputShaper::queueSizeFor(float max_step_rate, uint32_t delay)
+{
+	float steps_per_tick= max_step_rate < STEP_TICKER_FREQUENCY ? max_step_rate / STEP_TICKER_FREQUENCY : 1.0F;
+	size_t needed= (size_t)ceilf(delay * steps_per_tick) + 2;
+	size_t size= 1;
+	while(size < needed) size <<= 1;
+	return size;
+}
+
+bool InputShaper::configure(TYPE type, float frequency, float damping, float max_step_rate)
+{
+	if(type != NONE && (frequency <= 0.0F || damping < 0.0F || damping >= 1.0F)) return false;
+
+	float a[MAX_IMPULSES], t[MAX_IMPULSES];
+	int n;
+	float df= sqrtf(1.0F - damping * damping);
+	float td= 1.0F / (frequency * df); // damped period
+	switch(type) {
+		case NONE:
+			n= 1;
+			a[0]= 1; t[0]= 0;
+			break;
+		case ZV: {
+			float k= expf(-damping * (float)M_PI / df);
+			n= 2;
+			a[0]= 1; a[1]= k;
+			t[0]= 0; t[1]= 0.5F * td;
+		} break;
+		case ZVD: {
+			float k= expf(-damping * (float)M_PI / df);
+			n= 3;
+			a[0]= 1; a[1]= 2 * k; a[2]= k * k;
+			t[0]= 0; t[1]= 0.5F * td; t[2]= td;
+		} break;
+		case MZV: {
+			float k= expf(-0.75F * damping * (float)M_PI / df);
+			float a1= 1.0F - 1.0F / sqrtf(2.0F);
+			n= 3;
+			a[0]= a1; a[1]= (sqrtf(2.0F) - 1.0F) * k; a[2]= a1 * k * k;
+			t[0]= 0; t[1]= 0.375F * td; t[2]= 0.75F * td;
+		} break;
+		default: return false;
+	}
+
+	if(n > 1) {
+		// the queue has to hold back every step commanded over the longest delay, or the steps would be shaped early
+		size_t size= queueSizeFor(max_step_rate, lroundf(t[n - 1] * STEP_TICKER_FREQUENCY));
+		if(size > SHAPER_MAX_QUEUE_SIZE) return false;
+		if(size > queue_size) {
+			delete [] queue;
+			queue= new uint32_t[size];
+			queue_size= size;
+		}
+	}
+
+	n_impulses= n;
+	this->type= type;
+	this->frequency= type == NONE ? 0 : frequency;
+	this->damping= type == NONE ? 0 : damping;
+
+	// the amplitudes must add up to exactly 1 so the shaped position ends up where the commanded one does
+	float sum= 0;
+	for (int i = 0; i < n_impulses; ++i) sum += a[i];
+	int32_t total= 0;
+	for (int i = 1; i < n_impulses; ++i) {
+		amplitude[i]= lroundf(a[i] / sum * 65536);
+		delay[i]= lroundf(t[i] * STEP_TICKER_FREQUENCY);
+		total += amplitude[i];
+	}
+	amplitude[0]= 65536 - total;
+	delay[0]= 0;
+
+	reset();
+	return true;
+}
+
+// NOTE only call when the actuator is not moving
+void InputShaper::reset()
+{
+	for (int i = 0; i < MAX_IMPULSES; ++i) {
+		position[i]= 0;
+		read[i]= 0;
+	}
+	if(type == NONE) n_impulses= 1;
+	output= 0;
+	now= 0;
+	head= 0;
+}
+
+// a step was commanded this tick
+void InputShaper::push(bool dir)
+{
+	position[0] += dir ? 1 : -1;
+	if(n_impulses == 1) return;
+
+	size_t h= next(head);
+	size_t oldest= read[n_impulses - 1];
+	if(h == oldest) {
+		// the queue is full, only when stepping faster than it was sized for. The oldest step is taken now by the
+		// impulses that are still waiting for it so no step is lost, but it is shaped early
+		for (int i = 1; i < n_impulses; ++i) {
+			if(read[i] == oldest) {
+				position[i] += (queue[oldest] & 1) ? 1 : -1;
+				read[i]= next(oldest);
+			}
+		}
+	}
+	queue[head]= (now << 1) | (dir ? 1 : 0);
+	head= h;
+}
+
+// returns 1 or -1 if the actuator needs to step that way to follow the shaped position, the caller calls moved() if it does
+int InputShaper::tick()
+{
+	++now;
+	int64_t shaped= (int64_t)amplitude[0] * position[0];
+	for (int i = 1; i < n_impulses; ++i) {
+		// the steps that were commanded at least delay ticks ago, the commanded rate is at most one step a tick
+		size_t r= read[i];
+		if(r != head && ((now << 1) - queue[r]) >> 1 >= delay[i]) {
+			position[i] += (queue[r] & 1) ? 1 : -1;
+			read[i]= next(r);
+		}
+		shaped += (int64_t)amplitude[i] * position[i];
+	}
+
+	int64_t error= shaped - (int64_t)output * 65536;
+	if(error >= 32768) return 1;
+	if(error <= -32768) return -1;
+	return 0;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Block.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+// the most commanded steps the shaper can hold back, a power of 2. The queue is sized to hold the steps at the fastest
+// step rate of the actuator over the shaper delay, a shaper that needs more than this is rejected
+#ifndef SHAPER_MAX_QUEUE_SIZE
+#define SHAPER_MAX_QUEUE_SIZE 4096
+#endif
+
+/**
+	Input shaper for one actuator, cancels the ringing of the machine at the given frequency.
+
+	The step stream from the step generator is convolved with the shaper impulses, the shaped position is
+	A0 * p(t) + A1 * p(t - T1) + A2 * p(t - T2) where p is the position the step generator has commanded,
+	so each commanded step is spread out over the shaper duration.
+	The commanded steps are pushed as they happen and held in a queue until the most delayed impulse has taken them,
+	tick() is then called every tick and returns the direction of the step the actuator should take to follow the
+	shaped position. Once the commanded steps stop, the shaped position ends up exactly where they did.
+*/
+class InputShaper
+{
+public:
+	enum TYPE { NONE, ZV, ZVD, MZV };
+
+	InputShaper() { configure(NONE, 0, 0); }
+	~InputShaper() { delete [] queue; }
+	InputShaper(const InputShaper&) = delete;
+	InputShaper& operator=(const InputShaper&) = delete;
+	// max_step_rate is the fastest the actuator steps in steps/sec, false if the queue for it would be too big
+	bool configure(TYPE type, float frequency, float damping, float max_step_rate= STEP_TICKER_FREQUENCY);
+	// true if the queue holds all the steps at max_step_rate over the longest delay
+	bool fits(float max_step_rate) const { return queueSizeFor(max_step_rate, delay[n_impulses - 1]) <= queue_size; }
+	size_t getQueueSize() const { return queue_size; }
+	TYPE getType() const { return type; }
+	float getFrequency() const { return frequency; }
+	float getDamping() const { return damping; }
+	void reset();
+
+	// Runs in ISR context
+	void push(bool dir);
+	int tick();
+	void moved(int dir) { output += dir; }
+	int32_t getPosition() const { return output; }
+	// true when there is nothing held back
+	bool isIdle() const { return read[n_impulses - 1] == head && output == position[0]; }
+
+private:
+	static const int MAX_IMPULSES= 3;
+	static size_t queueSizeFor(float max_step_rate, uint32_t delay);
+	size_t next(size_t i) const { return (i + 1) & (queue_size - 1); }
+
+	TYPE type{NONE};
+	float frequency{0};
+	float damping{0};
+	int n_impulses;
+	// the delay in ticks and the amplitude (as a fraction of 65536) of each impulse, the first has no delay
+	uint32_t delay[MAX_IMPULSES];
+	int32_t amplitude[MAX_IMPULSES];
+	// the commanded position, delayed by each impulse, and the index of the next queued step each delayed position takes
+	int32_t position[MAX_IMPULSES];
+	size_t read[MAX_IMPULSES];
+	int32_t output; // where the actuator has been stepped to
+	uint32_t now;
+	// the tick each commanded step happened shifted up 1, with the direction in bit 0, oldest at read[n_impulses - 1]
+	uint32_t *queue{nullptr};
+	size_t queue_size{0};
+	size_t head;
+};
@@ -0,0 +1,91 @@
+/**
+	The delta solution is from Smoothie
+	https://github.com/Smoothieware/Smoothieware/blob/edge/src/modules/robot/arm_solutions/LinearDeltaSolution.cpp
+*/
+#include "Kinematics.h"
+
+#include <cmath>
+
+void CartesianKinematics::cartesianToActuator(const float cartesian[3], float actuator[3]) const
+{
+	for (int i = 0; i < 3; ++i) actuator[i]= cartesian[i];
+}
+
+void CartesianKinematics::actuatorToCartesian(const float actuator[3], float cartesian[3]) const
+{
+	for (int i = 0; i < 3; ++i) cartesian[i]= actuator[i];
+}
+
+void DeltaKinematics::setGeometry(float arm_length, float arm_radius)
+{
+	this->arm_length= arm_length;
+	this->arm_radius= arm_radius;
+	arm_length_squared= arm_length * arm_length;
+
+	const float sin60= 0.8660254037F;
+	tower_x[0]= -sin60 * arm_radius;
+	tower_y[0]= -0.5F * arm_radius;
+	tower_x[1]= sin60 * arm_radius;
+	tower_y[1]= -0.5F * arm_radius;
+	tower_x[2]= 0.0F;
+	tower_y[2]= arm_radius;
+}
+
+// each carriage is an arm length from the effector, so it is as far above it as the arm reaches up
+void DeltaKinematics::cartesianToActuator(const float cartesian[3], float actuator[3]) const
+{
+	for (int i = 0; i < 3; ++i) {
+		float dx= tower_x[i] - cartesian[0];
+		float dy= tower_y[i] - cartesian[1];
+		actuator[i]= sqrtf(arm_length_squared - dx * dx - dy * dy) + cartesian[2];
+	}
+}
+
+// each arm has to reach the effector, it can not be further from a tower than the arm is long, the reachable area is where
+// the three circles overlap so a straight line between two reachable positions is reachable all along it
+bool DeltaKinematics::isReachable(const float cartesian[3]) const
+{
+	for (int i = 0; i < 3; ++i) {
+		float dx= tower_x[i] - cartesian[0];
+		float dy= tower_y[i] - cartesian[1];
+		if(arm_length_squared - dx * dx - dy * dy <= 0) return false;
+	}
+	return true;
+}
+
+static inline void sub(const float *a, const float *b, float *r) { for (int i = 0; i < 3; ++i) r[i]= a[i] - b[i]; }
+static inline float dot(const float *a, const float *b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; }
+
+// the effector is where the three spheres of arm length around the carriages meet, the lower of the two points
+void DeltaKinematics::actuatorToCartesian(const float actuator[3], float cartesian[3]) const
+{
+	float t1[3]{tower_x[0], tower_y[0], actuator[0]};
+	float t2[3]{tower_x[1], tower_y[1], actuator[1]};
+	float t3[3]{tower_x[2], tower_y[2], actuator[2]};
+
+	float s12[3], s23[3], s13[3];
+	sub(t1, t2, s12);
+	sub(t2, t3, s23);
+	sub(t1, t3, s13);
+
+	float normal[3]{s12[1] * s23[2] - s12[2] * s23[1], s12[2] * s23[0] - s12[0] * s23[2], s12[0] * s23[1] - s12[1] * s23[0]};
+
+	float magsq_s12= dot(s12, s12);
+	float magsq_s23= dot(s23, s23);
+	float magsq_s13= dot(s13, s13);
+
+	float inv_nmag_sq= 1.0F / dot(normal, normal);
+	float q= 0.5F * inv_nmag_sq;
+
+	float a= q * magsq_s23 * dot(s12, s13);
+	float b= -q * magsq_s13 * dot(s12, s23); // negated as s12 is used instead of s21
+	float c= q * magsq_s12 * dot(s13, s23);
+
+	float r_sq= 0.5F * q * magsq_s12 * magsq_s23 * magsq_s13;
+	float dist= sqrtf(inv_nmag_sq * (arm_length_squared - r_sq));
+
+	for (int i = 0; i < 3; ++i) {
+		float circumcenter= t1[i] * a + t2[i] * b + t3[i] * c;
+		cartesian[i]= circumcenter - normal[i] * dist;
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+/**
+	Converts between the cartesian positions the gcode asks for and the positions of the X, Y and Z actuators.
+	Only the three primary axis go through the kinematics, any other actuator (eg E) moves as it is told to.
+*/
+class Kinematics
+{
+public:
+	virtual ~Kinematics() {}
+	virtual void cartesianToActuator(const float cartesian[3], float actuator[3]) const= 0;
+	virtual void actuatorToCartesian(const float actuator[3], float cartesian[3]) const= 0;
+	// true if a straight line in cartesian space is a straight line for the actuators, so moves do not need segmenting
+	virtual bool isLinear() const { return false; }
+	// false if the actuators can not get the effector to the position
+	virtual bool isReachable(const float cartesian[3]) const { (void)cartesian; return true; }
+};
+
+class CartesianKinematics : public Kinematics
+{
+public:
+	void cartesianToActuator(const float cartesian[3], float actuator[3]) const;
+	void actuatorToCartesian(const float actuator[3], float cartesian[3]) const;
+	bool isLinear() const { return true; }
+};
+
+// linear delta, the X, Y and Z actuators are the carriages on the towers at 210°, 330° and 90°
+class DeltaKinematics : public Kinematics
+{
+public:
+	DeltaKinematics() { setGeometry(250.0F, 124.0F); }
+	void cartesianToActuator(const float cartesian[3], float actuator[3]) const;
+	void actuatorToCartesian(const float actuator[3], float cartesian[3]) const;
+	bool isReachable(const float cartesian[3]) const;
+	// arm_length is the diagonal rod length, arm_radius the horizontal distance from the effector to a carriage when centered
+	void setGeometry(float arm_length, float arm_radius);
+	float getArmLength() const { return arm_length; }
+	float getArmRadius() const { return arm_radius; }
+
+private:
+	float arm_length;
+	float arm_radius;
+	float arm_length_squared;
+	float tower_x[3];
+	float tower_y[3];
+};
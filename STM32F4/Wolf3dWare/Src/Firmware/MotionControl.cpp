@@ -4,12 +4,14 @@
 #include "GCode.h"
 #include "Planner.h"
 #include "Actuator.h"
+#include "Block.h"
 
 
 #include <string.h>
 #include <functional>
 #include <algorithm>
 #include <iostream>
+#include <cmath>
 using namespace std;
 
 
@@ -17,6 +19,9 @@ MotionControl::MotionControl()
 {
 	inch_mode= false;
 	absolute_mode= true;
+	blend_mode= false;
+	move_pending= false;
+	line_pending= false;
 	seek_rate= 6000;
 	feed_rate= 6000;
 }
@@ -28,11 +33,18 @@ MotionControl::~MotionControl()
 void MotionControl::addActuator(Actuator& actuator, bool primary)
 {
 	int i= actuators.size();
+	// a Block can only hold MAX_AXES actuators
+	if(i >= MAX_AXES) return;
+
 	char axis= actuator.getAxis();
 	actuators.push_back(actuator);
 	actuator_axis_lut.push_back(axis);
 	axis_actuator_map[axis]= i;
 	last_milestone.push_back(0);
+	planned_position.push_back(0);
+	line_start.push_back(0);
+	line_end.push_back(0);
+	joints.resize(MAX_JOINED_LINES * (i + 1));
 	primary_axis.push_back(primary);
 }
 
@@ -44,8 +56,15 @@ void MotionControl::initialize()
 	// G codes
 	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 0,  std::bind( &MotionControl::handleG0G1, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 1,  std::bind( &MotionControl::handleG0G1, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 2,  std::bind( &MotionControl::handleG2G3, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 3,  std::bind( &MotionControl::handleG2G3, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 17, std::bind( &MotionControl::handleSettings, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 18, std::bind( &MotionControl::handleSettings, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 19, std::bind( &MotionControl::handleSettings, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 20, std::bind( &MotionControl::handleSettings, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 21, std::bind( &MotionControl::handleSettings, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 61, std::bind( &MotionControl::handleSettings, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 64, std::bind( &MotionControl::handleSettings, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 90, std::bind( &MotionControl::handleSettings, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 91, std::bind( &MotionControl::handleSettings, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::GCODE_HANDLER, 92, std::bind( &MotionControl::handleSetAxisPosition, this, _1) );
@@ -59,8 +78,13 @@ void MotionControl::initialize()
 	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 120, std::bind( &MotionControl::handlePushState, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 121, std::bind( &MotionControl::handlePushState, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 203, std::bind( &MotionControl::handleConfigurations, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 205, std::bind( &MotionControl::handleConfigurations, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 220, std::bind( &MotionControl::handleSetSpeedOverride, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 400, std::bind( &MotionControl::handleWaitForMoves, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 593, std::bind( &MotionControl::handleConfigurations, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 665, std::bind( &MotionControl::handleConfigurations, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 669, std::bind( &MotionControl::handleConfigurations, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 900, std::bind( &MotionControl::handleConfigurations, this, _1) );
 
 	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 500, std::bind( &MotionControl::handleSaveConfiguration, this, _1) );
 
@@ -124,19 +148,33 @@ bool MotionControl::handleEnable(GCode& gc)
 
 void MotionControl::waitForMoves()
 {
+	flushMoves();
+
 	// Wait for the queue to empty
 	THEKERNEL.getPlanner().moveAllToReady();
 
-	// block until we are told the queue is empty
+	// block until we are told the queue is empty, blocks are only released once they have been executed
 	// FIXME this is the dumb way to do it
-	while(!THEKERNEL.getPlanner().getReadyQueue().empty()) {
+	while(!THEKERNEL.getPlanner().getQueue().empty()) {
 		THEKERNEL.delay(100);
 	}
+
+	// and for the input shapers to finish the last move
+	while(isShaping()) {
+		THEKERNEL.delay(1);
+	}
 }
 
 // M400
+// M400.1 reports how long the queued moves will take without waiting
 bool MotionControl::handleWaitForMoves(GCode& gc)
 {
+	if(gc.getSubcode() == 1) {
+		Planner& planner= THEKERNEL.getPlanner();
+		gc.getOS().printf("T:%1.3f B:%d", planner.getRemainingTime(), (int)planner.getQueue().size());
+		gc.getOS().setAppendNL();
+		return true;
+	}
 	waitForMoves();
 	return true;
 }
@@ -148,26 +186,26 @@ bool MotionControl::handleSetSpeedOverride(GCode& gc)
 		float factor = gc.getArg('S');
 		factor= std::max(factor, 10.0F);
 		factor= std::min(factor, 1000.0F);
-		seconds_per_minute = 6000.0F / factor;
+		// also changes the speed of the moves already queued
+		THEKERNEL.getPlanner().setSpeedOverride(factor / 100.0F);
+		// and the one that is running
+		changeSpeed();
 	}else{
-		gc.getOS().printf("Current speed override: %f\n", 6000.0F / seconds_per_minute);
+		gc.getOS().printf("Current speed override: %f\n", THEKERNEL.getPlanner().getSpeedOverride() * 100.0F);
 	}
 
 	return true;
 }
 
-bool MotionControl::handleG0G1(GCode& gc)
+// get the target for each axis from the gcode, defaults to last_milestone
+void MotionControl::getTarget(GCode& gc, float *target)
 {
-	const int n_axis= actuators.size();
-	float target[n_axis];
-
-	// for each axis get the target, defaults to last_target
-	for (int i = 0; i < n_axis; ++i) {
+	for (size_t i = 0; i < actuators.size(); ++i) {
 		char c= actuator_axis_lut[i];
 		if( gc.hasArg(c) ) {
 			float d= toMillimeters(gc.getArg(c));
-			if(gc.getCode() == 1) {
-				// Only for G1 apply the scale
+			if(gc.getCode() != 0) {
+				// Only for G1, G2 and G3 apply the scale
 				// scale can be used for volumetric extrusion and/or filament
 				// flowrate adjustment or convert from any units to mm, usually from mm³ to mm
 				d *= actuators[i].getScale();
@@ -178,6 +216,13 @@ bool MotionControl::handleG0G1(GCode& gc)
 			target[i] = last_milestone[i];
 		}
 	}
+}
+
+bool MotionControl::handleG0G1(GCode& gc)
+{
+	const int n_axis= actuators.size();
+	float target[n_axis];
+	getTarget(gc, target);
 
 	if( gc.hasArg('F') ) {
 		float f= toMillimeters(gc.getArg('F'));
@@ -185,11 +230,426 @@ bool MotionControl::handleG0G1(GCode& gc)
 		else feed_rate = f;
 	}
 
-	// submit to planner
-	THEKERNEL.getPlanner().plan(last_milestone.data(), target, n_axis, actuators.data(), (gc.getCode() == 0 ? seek_rate : feed_rate) / seconds_per_minute );
+	// the last position was reachable, and the area a delta reaches is convex, so if the target is so is the whole line
+	if(!isReachable(target)) {
+		gc.getOS().printf("// WARNING target is out of reach, move ignored\n");
+		return true;
+	}
+
+	appendLine(target, (gc.getCode() == 0 ? seek_rate : feed_rate) / 60.0F);
+	return true;
+}
+
+// submits a line from last_milestone to target to the planner, in G64 mode the end of it is held back so it can be blended with the next line
+void MotionControl::appendLine(const float *target, float rate_mms)
+{
+	const int n_axis= actuators.size();
+	if(!blend_mode) {
+		// submit to planner
+		planLine(last_milestone.data(), target, rate_mms);
+
+	}else{
+		if(move_pending) {
+			// joins the pending line to this one
+			blendCorner(target, rate_mms);
+		}else{
+			planned_position= last_milestone;
+		}
+		move_pending= true;
+		pending_rate= rate_mms;
+	}
 
 	// update last_target
 	std::copy(target, target+n_axis, last_milestone.begin());
+}
+
+// submits the lines held back by G64 blending and joining, called before anything that is not a linear move is executed
+void MotionControl::flushMoves()
+{
+	if(move_pending) {
+		move_pending= false;
+		planLine(planned_position.data(), last_milestone.data(), pending_rate);
+	}
+	flushLine();
+}
+
+// gives a line to the planner, with G64 Q set consecutive lines that are in line to within the tolerance are joined into
+// one line first, so the long runs of tiny nearly collinear segments slicers produce become one block
+void MotionControl::planLine(const float *start, const float *end, float rate_mms)
+{
+	const int n_axis= actuators.size();
+	if(line_pending) {
+		if(rate_mms == line_rate && std::equal(start, start+n_axis, line_end.begin()) && joinLine(end)) {
+			std::copy(end, end+n_axis, line_end.begin());
+			return;
+		}
+		flushLine();
+	}
+
+	if(join_tolerance <= 0) {
+		segmentLine(start, end, rate_mms);
+		return;
+	}
+
+	// hold it back in case the next line continues it
+	std::copy(start, start+n_axis, line_start.begin());
+	std::copy(end, end+n_axis, line_end.begin());
+	line_rate= rate_mms;
+	line_joints= 0;
+	line_pending= true;
+}
+
+// submits the line being joined
+void MotionControl::flushLine()
+{
+	if(!line_pending) return;
+	line_pending= false;
+	segmentLine(line_start.data(), line_end.data(), line_rate);
+}
+
+// gives a line to the planner, when the kinematics are not linear (delta) a straight line is not straight for the actuators
+// so it is split into segments, segments_per_second of them at the requested speed, and each is converted to actuator positions
+void MotionControl::segmentLine(const float *start, const float *end, float rate_mms)
+{
+	const int n_axis= actuators.size();
+	Planner& planner= THEKERNEL.getPlanner();
+	if(kinematics->isLinear()) {
+		planner.plan(start, end, n_axis, actuators.data(), rate_mms);
+		return;
+	}
+
+	float lsq= 0;
+	for (int i = 0; i < n_axis; ++i) {
+		if(!isPrimaryAxis(i)) continue;
+		float d= end[i] - start[i];
+		lsq += d * d;
+	}
+	uint32_t segments= std::max(1.0F, ceilf(sqrtf(lsq) / rate_mms * segments_per_second));
+
+	float from[n_axis], to[n_axis], actuator[n_axis];
+	std::copy(start, start+n_axis, from);
+	for (uint32_t j = 1; j <= segments; ++j) {
+		float t= (float)j / segments;
+		for (int i = 0; i < n_axis; ++i) {
+			to[i]= (j == segments) ? end[i] : start[i] + (end[i] - start[i]) * t;
+		}
+		toActuators(to, actuator);
+		planner.plan(from, to, n_axis, actuators.data(), rate_mms, actuator);
+		std::copy(to, to+n_axis, from);
+	}
+}
+
+// true if the kinematics can get to the X, Y and Z of the cartesian position
+bool MotionControl::isReachable(const float *cartesian) const
+{
+	float c[3];
+	for (int i = 0; i < 3; ++i) c[i]= cartesian[getAxisActuator('X' + i)];
+	return kinematics->isReachable(c);
+}
+
+// converts a cartesian position to actuator positions, the axis other than X, Y and Z are not changed
+void MotionControl::toActuators(const float *cartesian, float *actuator)
+{
+	const int n_axis= actuators.size();
+	uint8_t xyz[3]{getAxisActuator('X'), getAxisActuator('Y'), getAxisActuator('Z')};
+	float c[3], a[3];
+	for (int i = 0; i < 3; ++i) c[i]= cartesian[xyz[i]];
+	kinematics->cartesianToActuator(c, a);
+	std::copy(cartesian, cartesian+n_axis, actuator);
+	for (int i = 0; i < 3; ++i) actuator[xyz[i]]= a[i];
+}
+
+// sets the actuator positions from last_milestone, after it is set with G92 or the kinematics change
+void MotionControl::updateActuatorPositions()
+{
+	float actuator[actuators.size()];
+	toActuators(last_milestone.data(), actuator);
+	for (size_t i = 0; i < actuators.size(); ++i) {
+		actuators[i].resetPositionInmm(actuator[i]);
+	}
+}
+
+// Checks if the line being joined can be extended to end, every point where the lines joined so far meet has to be within the
+// tolerance of the new line, measured at right angles to it in the primary axis. The other axis (eg E) must be within what they
+// move in the tolerance along the new line, so the E per mm can not change much either. Upto MAX_JOINED_LINES are joined.
+bool MotionControl::joinLine(const float *end)
+{
+	const int n_axis= actuators.size();
+	if(line_joints >= MAX_JOINED_LINES - 1) return false;
+
+	// the new joint is where the line being joined ends now
+	std::copy(line_end.begin(), line_end.end(), joints.begin() + line_joints * n_axis);
+
+	float lsq= 0;
+	for (int i = 0; i < n_axis; ++i) {
+		if(!isPrimaryAxis(i)) continue;
+		float d= end[i] - line_start[i];
+		lsq += d * d;
+	}
+	if(lsq == 0) return false;
+	float l= sqrtf(lsq);
+
+	for (int j = 0; j <= line_joints; ++j) {
+		const float *joint= &joints[j * n_axis];
+
+		// how far along the new line the joint is, it must be between the ends or the line turned back on itself
+		float t= 0;
+		for (int i = 0; i < n_axis; ++i) {
+			if(isPrimaryAxis(i)) t += (joint[i] - line_start[i]) * (end[i] - line_start[i]);
+		}
+		t /= lsq;
+		if(t <= 0 || t >= 1) return false;
+
+		float dsq= 0;
+		for (int i = 0; i < n_axis; ++i) {
+			float e= joint[i] - (line_start[i] + (end[i] - line_start[i]) * t);
+			if(isPrimaryAxis(i)) {
+				dsq += e * e;
+			}else if(fabsf(e) > join_tolerance * fabsf(end[i] - line_start[i]) / l) {
+				return false;
+			}
+		}
+		if(dsq > join_tolerance * join_tolerance) return false;
+	}
+
+	++line_joints;
+	return true;
+}
+
+// Joins the pending line, which ends at the corner last_milestone, to the line from the corner to target with a circular blend
+// that cuts the corner by no more than blend_tolerance, so the corner can be taken at speed instead of slowing down for it.
+// The pending line up to the blend and the blend itself are given to the planner and the rest of the new line becomes pending.
+// The blend is in the plane of the two lines, it uses the primary axis, any other axis (eg E) moves in proportion.
+void MotionControl::blendCorner(const float *target, float rate_mms)
+{
+	const int n_axis= actuators.size();
+	const float *corner= last_milestone.data();
+	float u1[n_axis], u2[n_axis];
+	float l1= 0, l2= 0;
+	for (int i = 0; i < n_axis; ++i) {
+		u1[i]= u2[i]= 0;
+		if(!isPrimaryAxis(i)) continue;
+		u1[i]= corner[i] - planned_position[i];
+		u2[i]= target[i] - corner[i];
+		l1 += u1[i] * u1[i];
+		l2 += u2[i] * u2[i];
+	}
+	l1= sqrtf(l1);
+	l2= sqrtf(l2);
+
+	float cos_theta= 0;
+	if(l1 > 0 && l2 > 0) {
+		for (int i = 0; i < n_axis; ++i) {
+			u1[i] /= l1;
+			u2[i] /= l2;
+			cos_theta += u1[i] * u2[i];
+		}
+	}
+
+	// no blend if either line does not move the primary axis, if they are in line or if it turns back on itself
+	if(l1 == 0 || l2 == 0 || cos_theta > 0.9999F || cos_theta < -0.9999F) {
+		flushMoves();
+		planned_position= last_milestone;
+		return;
+	}
+
+	// the blend is tangent to both lines, it starts d before the corner and ends d after it, with its middle tolerance from the corner
+	float half_theta= acosf(cos_theta) / 2.0F;
+	float tan_half= tanf(half_theta);
+	float cos_half= cosf(half_theta);
+	float radius= blend_tolerance * cos_half / (1.0F - cos_half);
+	float d= radius * tan_half;
+
+	// leave half the new line for the next corner
+	if(d > l1 || d > l2 / 2.0F) {
+		d= std::min(l1, l2 / 2.0F);
+		radius= d / tan_half;
+	}
+
+	// the pending line up to the start of the blend
+	float p[n_axis];
+	for (int i = 0; i < n_axis; ++i) {
+		p[i]= planned_position[i] + (corner[i] - planned_position[i]) * (l1 - d) / l1;
+	}
+	if(d < l1) planLine(planned_position.data(), p, pending_rate);
+	std::copy(p, p+n_axis, planned_position.begin());
+
+	// unit vector from the start of the blend towards the center of the blend
+	float m[n_axis];
+	float lm= 0;
+	for (int i = 0; i < n_axis; ++i) {
+		m[i]= u2[i] - cos_theta * u1[i];
+		lm += m[i] * m[i];
+	}
+	lm= sqrtf(lm);
+
+	// the other axis go from where they are at the start of the blend to where they are at the end of it
+	float start[n_axis], end[n_axis];
+	for (int i = 0; i < n_axis; ++i) {
+		m[i] /= lm;
+		start[i]= p[i];
+		end[i]= corner[i] + (target[i] - corner[i]) * d / l2;
+	}
+
+	// the blend is an arc of 2*half_theta around the center, split into chords within arc_tolerance like G2/G3
+	// p(phi)= start + radius * (u1 * sin(phi) + m * (1 - cos(phi))), the sin and cos are stepped on by rotation
+	float theta= 2.0F * half_theta;
+	float segment_angle= (arc_tolerance < radius) ? 2.0F * acosf(1.0F - arc_tolerance / radius) : theta;
+	uint32_t segments= std::max(1.0F, ceilf(theta / segment_angle));
+	float cos_t= cosf(theta / segments);
+	float sin_t= sinf(theta / segments);
+	float c= 1.0F, s= 0.0F;
+	float rate= std::min(pending_rate, rate_mms);
+	for (uint32_t j = 1; j < segments; ++j) {
+		float cn= c * cos_t - s * sin_t;
+		s= s * cos_t + c * sin_t;
+		c= cn;
+		for (int i = 0; i < n_axis; ++i) {
+			if(isPrimaryAxis(i)) {
+				p[i]= start[i] + radius * (u1[i] * s + m[i] * (1.0F - c));
+			}else{
+				p[i]= start[i] + (end[i] - start[i]) * j / segments;
+			}
+		}
+		planLine(planned_position.data(), p, rate);
+		std::copy(p, p+n_axis, planned_position.begin());
+	}
+	planLine(planned_position.data(), end, rate);
+	std::copy(end, end+n_axis, planned_position.begin());
+}
+
+// G2 clockwise and G3 counter clockwise arcs in the plane selected by G17, G18 or G19
+// the center is given by I J K offsets from the start, or by an R radius (negative R for the long way round)
+bool MotionControl::handleG2G3(GCode& gc)
+{
+	const int n_axis= actuators.size();
+	float target[n_axis];
+	getTarget(gc, target);
+
+	if( gc.hasArg('F') ) {
+		feed_rate = toMillimeters(gc.getArg('F'));
+	}
+
+	bool clockwise= (gc.getCode() == 2);
+	uint8_t a0= getAxisActuator(plane_axis[0]);
+	uint8_t a1= getAxisActuator(plane_axis[1]);
+	float offset[2]{0, 0};
+
+	if(gc.hasArg('R')) {
+		// find the center from the radius, this is from grbl gcode.c
+		float x= target[a0] - last_milestone[a0];
+		float y= target[a1] - last_milestone[a1];
+		float r= toMillimeters(gc.getArg('R'));
+		float h_x2_div_d= 4.0F * r * r - x * x - y * y;
+		if(h_x2_div_d < 0 || (x == 0 && y == 0)) {
+			gc.getOS().printf("// WARNING arc radius is too small or the end point is the start point\n");
+			return true;
+		}
+		h_x2_div_d= -sqrtf(h_x2_div_d) / hypotf(x, y);
+		if(!clockwise) h_x2_div_d= -h_x2_div_d;
+		if(r < 0) h_x2_div_d= -h_x2_div_d; // the long way round
+		offset[0]= 0.5F * (x - (y * h_x2_div_d));
+		offset[1]= 0.5F * (y + (x * h_x2_div_d));
+
+	}else{
+		// I J K are the offsets for X Y Z
+		for (int i = 0; i < 2; ++i) {
+			char c= 'I' + (plane_axis[i] - 'X');
+			if(gc.hasArg(c)) offset[i]= toMillimeters(gc.getArg(c));
+		}
+		if(offset[0] == 0 && offset[1] == 0) {
+			gc.getOS().printf("// WARNING arc has no center offset\n");
+			return true;
+		}
+	}
+
+	if(!appendArc(target, offset, clockwise, feed_rate / 60.0F)) {
+		gc.getOS().printf("// WARNING arc goes out of reach, move ignored\n");
+	}
+	return true;
+}
+
+// Breaks the arc into chords no further than arc_tolerance from the arc and sends each one to the planner.
+// Based on mc_arc() from grbl, the chord is rotated to the next segment with a rotation matrix worked out once per arc,
+// so there are no sin/cos calls per segment, every ARC_CORRECTION segments the position is recalculated exactly to stop
+// rounding errors building up. Axis not in the plane move linearly, which gives helical moves.
+#define ARC_CORRECTION 16
+#define ARC_ANGULAR_TRAVEL_EPSILON 5E-7F
+bool MotionControl::appendArc(const float *target, const float *offset, bool clockwise, float rate_mms)
+{
+	const int n_axis= actuators.size();
+	uint8_t a0= getAxisActuator(plane_axis[0]);
+	uint8_t a1= getAxisActuator(plane_axis[1]);
+
+	float center0= last_milestone[a0] + offset[0];
+	float center1= last_milestone[a1] + offset[1];
+	float radius= hypotf(offset[0], offset[1]);
+
+	// radius vector from the center to the current position and to the target
+	float r0= -offset[0];
+	float r1= -offset[1];
+	float rt0= target[a0] - center0;
+	float rt1= target[a1] - center1;
+
+	// counter clockwise angle between the position and the target, the same point is a full circle
+	float angular_travel= atan2f(r0 * rt1 - r1 * rt0, r0 * rt0 + r1 * rt1);
+	if(clockwise) {
+		if(angular_travel >= -ARC_ANGULAR_TRAVEL_EPSILON) angular_travel -= 2.0F * (float)M_PI;
+	}else{
+		if(angular_travel <= ARC_ANGULAR_TRAVEL_EPSILON) angular_travel += 2.0F * (float)M_PI;
+	}
+
+	// the angle of the longest chord whose sagitta is within the tolerance
+	float segment_angle= (arc_tolerance < radius) ? 2.0F * acosf(1.0F - arc_tolerance / radius) : (float)M_PI;
+	uint32_t segments= std::max(1.0F, ceilf(fabsf(angular_travel) / segment_angle));
+
+	float theta_per_segment= angular_travel / segments;
+	float cos_t= cosf(theta_per_segment);
+	float sin_t= sinf(theta_per_segment);
+
+	float start[n_axis];
+	float arc_target[n_axis];
+	std::copy(last_milestone.begin(), last_milestone.end(), start);
+
+	if(!kinematics->isLinear()) {
+		// an arc can leave the reachable area between two reachable points, so every chord end is checked before any is planned
+		std::copy(target, target+n_axis, arc_target);
+		for (uint32_t i = 1; i <= segments; ++i) {
+			float c= cosf(i * theta_per_segment);
+			float s= sinf(i * theta_per_segment);
+			arc_target[a0]= center0 - offset[0] * c + offset[1] * s;
+			arc_target[a1]= center1 - offset[0] * s - offset[1] * c;
+			if(!isReachable(arc_target)) return false;
+		}
+	}
+
+	for (uint32_t i = 1; i < segments; ++i) {
+		if((i % ARC_CORRECTION) == 0) {
+			// exact position from the start of the arc
+			float c= cosf(i * theta_per_segment);
+			float s= sinf(i * theta_per_segment);
+			r0= -offset[0] * c + offset[1] * s;
+			r1= -offset[0] * s - offset[1] * c;
+		}else{
+			// rotate the radius vector on by one segment
+			float r0n= r0 * cos_t - r1 * sin_t;
+			r1= r0 * sin_t + r1 * cos_t;
+			r0= r0n;
+		}
+
+		for (int j = 0; j < n_axis; ++j) {
+			arc_target[j]= start[j] + (target[j] - start[j]) * i / segments;
+		}
+		arc_target[a0]= center0 + r0;
+		arc_target[a1]= center1 + r1;
+
+		planLine(last_milestone.data(), arc_target, rate_mms);
+		std::copy(arc_target, arc_target+n_axis, last_milestone.begin());
+	}
+
+	// the last segment goes exactly to the target
+	planLine(last_milestone.data(), target, rate_mms);
+	std::copy(target, target+n_axis, last_milestone.begin());
 	return true;
 }
 
@@ -223,6 +683,15 @@ bool MotionControl::handleSettings(GCode& gc)
 		case 21: inch_mode = false; break;
 		case 90: absolute_mode = true; break;
 		case 91: absolute_mode = false; break;
+		case 17: plane_axis[0]= 'X'; plane_axis[1]= 'Y'; plane_axis[2]= 'Z'; break;
+		case 18: plane_axis[0]= 'Z'; plane_axis[1]= 'X'; plane_axis[2]= 'Y'; break;
+		case 19: plane_axis[0]= 'Y'; plane_axis[1]= 'Z'; plane_axis[2]= 'X'; break;
+		case 61: blend_mode = false; break; // exact path
+		case 64: // continuous path, P sets the blend tolerance, Q the tolerance for joining lines that are in line (Q0 does not join them)
+			if(gc.hasArg('P')) blend_tolerance= toMillimeters(gc.getArg('P'));
+			if(gc.hasArg('Q')) join_tolerance= toMillimeters(gc.getArg('Q'));
+			blend_mode = blend_tolerance > 0;
+			break;
 		default: return false;
 	}
 
@@ -242,6 +711,21 @@ bool MotionControl::handleSaveConfiguration(GCode& gc)
 		gc.getOS().printf("%c%1.4f ", a.getAxis(), a.getMaxSpeed());
 	}
 	gc.getOS().printf("\n");
+	gc.getOS().printf("M205 Q%1.4f\n", arc_tolerance);
+	for(auto& a : actuators) {
+		const InputShaper *s= a.getInputShaper();
+		if(s != nullptr) {
+			gc.getOS().printf("M593 %c%d F%1.4f D%1.4f\n", a.getAxis(), s->getType(), s->getFrequency(), s->getDamping());
+		}
+	}
+	if(kinematics == &delta_kinematics) {
+		gc.getOS().printf("M669 K3\n");
+		gc.getOS().printf("M665 L%1.4f R%1.4f S%1.4f\n", delta_kinematics.getArmLength(), delta_kinematics.getArmRadius(), segments_per_second);
+	}
+	auto e= axis_actuator_map.find('E');
+	if(e != axis_actuator_map.end() && actuators[e->second].getPressureAdvance() > 0) {
+		gc.getOS().printf("M900 K%1.4f\n", actuators[e->second].getPressureAdvance());
+	}
 	return true;
 }
 
@@ -257,6 +741,9 @@ bool MotionControl::handleConfigurations(GCode& gc)
 					if(!actuators[i->second].checkMaxSpeed()) {
 						gc.getOS().printf("// WARNING maxspeed for axis %c exceeds maximum steps/sec\n", arg.first);
 					}
+					if(!actuators[i->second].checkInputShaper()) {
+						gc.getOS().printf("// WARNING input shaper for axis %c is too small for its maxspeed, set it again with M593\n", arg.first);
+					}
 				}
 			}
 			for(auto& a : actuators) {
@@ -273,6 +760,9 @@ bool MotionControl::handleConfigurations(GCode& gc)
 					if(!actuators[i->second].checkMaxSpeed()) {
 						gc.getOS().printf("// WARNING maxspeed for axis %c exceeds maximum steps/sec\n", arg.first);
 					}
+					if(!actuators[i->second].checkInputShaper()) {
+						gc.getOS().printf("// WARNING input shaper for axis %c is too small for its maxspeed, set it again with M593\n", arg.first);
+					}
 				}
 			}
 			for(auto& a : actuators) {
@@ -281,6 +771,72 @@ bool MotionControl::handleConfigurations(GCode& gc)
 			gc.getOS().setAppendNL();
 			break;
 
+		case 205: // M205 Qnnn - set the arc tolerance in mm, the rest of M205 is handled by the Planner
+			if (gc.hasArg('Q')) {
+				arc_tolerance= toMillimeters(gc.getArg('Q'));
+			}
+			break;
+
+		case 665: // M665 Lnnn Rnnn Snnn - set the delta arm length and radius in mm, and how many segments per second lines are split into
+			if(gc.hasArg('L') || gc.hasArg('R')) {
+				float l= gc.hasArg('L') ? gc.getArg('L') : delta_kinematics.getArmLength();
+				float r= gc.hasArg('R') ? gc.getArg('R') : delta_kinematics.getArmRadius();
+				delta_kinematics.setGeometry(l, r);
+				updateActuatorPositions();
+			}
+			if(gc.hasArg('S')) {
+				segments_per_second= std::max(1.0F, gc.getArg('S'));
+			}
+			gc.getOS().printf("L:%1.4f R:%1.4f S:%1.4f", delta_kinematics.getArmLength(), delta_kinematics.getArmRadius(), segments_per_second);
+			gc.getOS().setAppendNL();
+			break;
+
+		case 669: // M669 Knnn - select the kinematics, K0 cartesian, K3 linear delta (numbered as RepRapFirmware does)
+			if(gc.hasArg('K')) {
+				switch((int)gc.getArg('K')) {
+					case 0: kinematics= &cartesian_kinematics; break;
+					case 3: kinematics= &delta_kinematics; break;
+					default: return false;
+				}
+				updateActuatorPositions();
+			}
+			gc.getOS().printf("K:%d", kinematics == &delta_kinematics ? 3 : 0);
+			gc.getOS().setAppendNL();
+			break;
+
+		case 593: // M593 Xn Yn ... Fnnn Dnnn - set the input shaper for each axis given, n is 0 none, 1 ZV, 2 ZVD, 3 MZV
+		          // F is the ringing frequency in Hz and D the damping ratio (default 0.1)
+			waitForMoves();
+			for(auto& arg : gc.getArgs()) {
+				auto i= axis_actuator_map.find(arg.first);
+				if(i == axis_actuator_map.end()) continue;
+				Actuator& a= actuators[i->second];
+				const InputShaper *s= a.getInputShaper();
+				float f= gc.hasArg('F') ? gc.getArg('F') : (s != nullptr ? s->getFrequency() : 0);
+				float d= gc.hasArg('D') ? gc.getArg('D') : (s != nullptr ? s->getDamping() : 0.1F);
+				int type= arg.second;
+				if(type < InputShaper::NONE || type > InputShaper::MZV || !a.setInputShaper((InputShaper::TYPE)type, f, d)) {
+					gc.getOS().printf("// WARNING bad input shaper for axis %c, or its delay is too long for the maxspeed\n", arg.first);
+				}
+			}
+			for(auto& a : actuators) {
+				const InputShaper *s= a.getInputShaper();
+				if(s != nullptr) gc.getOS().printf("%c:%d %1.4fHz %1.4f ", a.getAxis(), s->getType(), s->getFrequency(), s->getDamping());
+			}
+			gc.getOS().setAppendNL();
+			break;
+
+		case 900: { // M900 Knnn - set the extruder pressure advance in seconds, K0 turns it off
+			auto e= axis_actuator_map.find('E');
+			if(e == axis_actuator_map.end()) return false;
+			if(gc.hasArg('K')) {
+				actuators[e->second].setPressureAdvance(gc.getArg('K'));
+			}
+			gc.getOS().printf("K:%1.4f", actuators[e->second].getPressureAdvance());
+			gc.getOS().setAppendNL();
+		}
+		break;
+
 		default: return false;
 	}
 
@@ -319,15 +875,30 @@ bool MotionControl::handleSetAxisPosition(GCode& gc)
 }
 
 void MotionControl::resetAxisPositions() {
+	move_pending= false;
+	line_pending= false;
+	hold_requested= false;
+	holding= false;
+	hold_speed= 0;
+	speed_changed= false;
+	reramping= false;
 	std::fill(last_milestone.begin(), last_milestone.end(), 0.0F);
-	for(auto& a : actuators) a.resetPositionInSteps(0);
+	if(kinematics->isLinear()) {
+		for(auto& a : actuators) a.resetPositionInSteps(0);
+	}else{
+		updateActuatorPositions();
+	}
 }
 
 void MotionControl::resetAxisPosition(char axis, float pos){
 	auto i= axis_actuator_map.find(axis);
 	if(i != axis_actuator_map.end()){
 		last_milestone[i->second]= pos;
-		actuators[i->second].resetPositionInmm(pos);
+		if(kinematics->isLinear() || !isPrimaryAxis(i->second)) {
+			actuators[i->second].resetPositionInmm(pos);
+		}else{
+			updateActuatorPositions();
+		}
 	}
 }
 
@@ -335,17 +906,54 @@ void MotionControl::resetAxisPosition(char axis, float pos){
 // Can run in High priority thread or low prio thread
 bool MotionControl::issueMove(const Block& block)
 {
-	Actuator::setCurrentBlock(block); // copies it to the static instance that each Actuator shares (saves memory)
+	Actuator::setCurrentBlock(block); // points the static instance that each Actuator shares at the block, it is executed in place
+	elapsed_ticks= 0;
+	executing_block= &block;
+	// the block was planned before the speed override changed, so it is re-ramped on its first tick
+	reramping= false;
+	if(block.nominal_speed != THEKERNEL.getPlanner().getOverriddenSpeed(block)) speed_changed= true;
 	//moving_mask= 0; // this could be used to optimize a bit
-	auto i= std::max_element(block.steps_to_move.begin(), block.steps_to_move.end());
-	float inv= 1.0F / *i ;
-	for (size_t i = 0; i < block.steps_to_move.size(); ++i) {
+	float inv= 1.0F / block.steps_event_count;
+	// pressure advance is only used when extruding while the primary axes move
+	bool printing= false;
+	for (size_t i = 0; i < actuators.size(); ++i) {
+		if(isPrimaryAxis(i) && block.steps_to_move[i] != 0) printing= true;
+	}
+	for (size_t i = 0; i < actuators.size(); ++i) {
 		uint32_t steps= block.steps_to_move[i];
 		if(steps == 0) continue;
 		//std::cout << "moving axis: " << actuators[i].getAxis() << "by " << steps << " steps\n";
-		actuators[i].move(block.direction[i], steps, steps*inv);
+		bool dir= block.getDirection(i);
+		actuators[i].move(dir, steps, steps*inv, printing && dir && !isPrimaryAxis(i));
 		//moving_mask |= (1<<i);
 	}
+
+#ifdef STEP_BRESENHAM
+	// the axis with the most steps runs the ramp, the others follow it unless they need their own step rate for pressure advance
+	dominant= 0;
+	for (size_t i = 0; i < actuators.size(); ++i) {
+		if(block.steps_to_move[i] == block.steps_event_count) {
+			dominant= i;
+			break;
+		}
+	}
+	// the slower the block the finer the followers are stepped, as long as the sub steps come no more than once a tick
+	amass_level= 0;
+	while(amass_level < MAX_AMASS_LEVEL && block.maximum_rate * (2 << amass_level) <= STEP_TICKER_FREQUENCY &&
+		block.steps_event_count < (UINT32_MAX >> (amass_level + 2))) {
+		++amass_level;
+	}
+	sub_steps_total= block.steps_event_count << amass_level;
+	sub_steps_done= 0;
+	n_followers= 0;
+	for (size_t i = 0; i < actuators.size(); ++i) {
+		if(i == dominant || block.steps_to_move[i] == 0 || actuators[i].isAdvancing()) continue;
+		actuators[i].follow();
+		followers[n_followers++]= i;
+		follower_steps[i]= block.steps_to_move[i];
+		follower_counter[i]= sub_steps_total / 2;
+	}
+#endif
 	//return moving_mask != 0;
 	return true;
 }
@@ -355,21 +963,215 @@ bool MotionControl::issueTicks(uint32_t current_tick)
 {
 	bool not_done= true;
 	stepped= false;
+	elapsed_ticks= current_tick;
+	if(hold_requested && !holding) {
+		// every axis decelerates to a stop, issueTicks() returns false when they have all stopped. The planner has the speed
+		// at each junction no lower than the hold gets it down to, but it is kept to the planned one in case of a re-ramp
+		holding= true;
+		if(hold_speed > 0) {
+			float speed= std::min(hold_speed, executing_block->entry_speed);
+			for (auto& a : actuators) a.hold(speed);
+		}else{
+			for (auto& a : actuators) a.hold();
+		}
+		hold_speed= 0;
+	}
+	if(!holding) {
+		if(speed_changed) {
+			speed_changed= false;
+			startReramp();
+		}
+		if(reramping) rerampTick();
+	}
 	for (auto& a : actuators) {
 		bool a_step;
 		if(a.tick(current_tick, a_step)) not_done= false;
+		if(a.shapeTick()) a_step= true;
 		if(a_step) stepped= true;
 	}
+#ifdef STEP_BRESENHAM
+	// the followers are not ticked, they step as the dominant axis moves on a sub step
+	if(n_followers > 0) {
+		const Actuator& d= actuators[dominant];
+		// when the dominant axis has finished the followers finish too, if it stopped for a feed hold they keep the steps they have left
+		uint32_t to= d.isMoving() || holding ? std::min(d.getSubSteps(amass_level), sub_steps_total) : sub_steps_total;
+		if(to != sub_steps_done && issueFollowerSteps(to)) stepped= true;
+	}
+#endif
+	// one write to each port for all the axes that stepped
+	if(stepped) ActuatorPins::flushSteps();
+
+	if(not_done && holding) holdPastBlock();
 
 	return !not_done;
 }
 
+// the hold needed more room to stop than the block had left, so rather than stopping dead at the end of it the hold is
+// started again on the next block from the speed it has got down to, and the executer moves on as it does at the end of
+// any block
+// runs in ISR context
+void MotionControl::holdPastBlock()
+{
+	const Block *block= executing_block;
+	size_t longest= 0;
+	for (size_t i = 0; i < actuators.size(); ++i) {
+		if(block->steps_to_move[i] == 0) continue;
+		if(actuators[i].getStepsLeft() != 0) return;
+		if(block->steps_to_move[i] == block->steps_event_count) longest= i;
+	}
+	float rate= actuators[longest].getStepRate();
+	if(rate <= 0) return;
+	hold_speed= rate * block->millimeters / block->steps_event_count;
+	holding= false;
+}
+
+// the speed override has changed since the executing block was planned, it ramps from where it is to the new speed at the
+// blocks acceleration, then rerampTick() brings it back to the planned exit speed in time for the next block, so the
+// next block still joins up with it
+// runs in ISR context
+void MotionControl::startReramp()
+{
+	const Block *block= executing_block;
+	if(block == nullptr) return;
+	float speed= THEKERNEL.getPlanner().getOverriddenSpeed(*block);
+	if(!reramping && speed == block->nominal_speed) return;
+
+	reramp_axis= 0;
+	for (size_t i = 0; i < actuators.size(); ++i) {
+		if(block->steps_to_move[i] == block->steps_event_count) {
+			reramp_axis= i;
+			break;
+		}
+	}
+	for (auto& a : actuators) a.reramp(speed);
+	reramping= true;
+	reramp_exiting= false;
+}
+
+// goes to the exit speed when the axis with the most steps has only just enough left to get there
+// runs in ISR context
+void MotionControl::rerampTick()
+{
+	if(reramp_exiting) return;
+	const Block *block= executing_block;
+	const Actuator& a= actuators[reramp_axis];
+	float scale= block->steps_event_count / block->millimeters;
+	float rate= a.getStepRate();
+	float exit_rate= block->exit_speed * scale;
+	// with a tick to spare
+	float steps= fabsf(rate * rate - exit_rate * exit_rate) / (2.0F * block->acceleration * scale) + rate / STEP_TICKER_FREQUENCY;
+	if(a.getStepsLeft() <= steps) {
+		for (auto& act : actuators) act.reramp(block->exit_speed);
+		reramp_exiting= true;
+	}
+}
+
+#ifdef STEP_BRESENHAM
+// steps the followers up to the sub step the dominant axis has got to, returns true if any of them stepped
+// runs in ISR context
+bool MotionControl::issueFollowerSteps(uint32_t to)
+{
+	bool s= false;
+	for (uint32_t n = sub_steps_done; n < to; ++n) {
+		for (uint8_t j = 0; j < n_followers; ++j) {
+			uint8_t i= followers[j];
+			follower_counter[i] += follower_steps[i];
+			if(follower_counter[i] >= sub_steps_total) {
+				follower_counter[i] -= sub_steps_total;
+				if(actuators[i].followStep()) s= true;
+			}
+		}
+	}
+	sub_steps_done= to;
+	return s;
+}
+#endif
+
+// for the event scheduled step timer, the ticks after current_tick that nothing steps in, skipTicks() runs them all at once
+// runs in ISR context
+uint32_t MotionControl::getIdleTicks(uint32_t current_tick) const
+{
+	// a feed hold starts on the next tick, and a re-ramp needs every tick
+	if(hold_requested && !holding) return 0;
+	if(speed_changed || (reramping && !reramp_exiting)) return 0;
+
+	uint32_t n= MAX_IDLE_TICKS;
+	for (size_t i = 0; i < actuators.size() && n > 0; ++i) {
+#ifdef STEP_BRESENHAM
+		// the followers step on the sub steps of the dominant axis
+		uint8_t level= (n_followers > 0 && i == dominant) ? amass_level : 0;
+#else
+		uint8_t level= 0;
+#endif
+		n= std::min(n, actuators[i].getIdleTicks(current_tick, level));
+	}
+	return n;
+}
+
+// runs in ISR context
+void MotionControl::skipTicks(uint32_t n)
+{
+	for (auto& a : actuators) a.skipTicks(n);
+	elapsed_ticks= elapsed_ticks + n;
+}
+
+// the input shapers carry on stepping for a while after the last move has finished, this has to be called every tick
+// when there is no move running until it returns false
+// runs in ISR context
+bool MotionControl::issueShaperTicks()
+{
+	stepped= false;
+	for (auto& a : actuators) {
+		if(a.shapeTick()) stepped= true;
+	}
+	if(stepped) ActuatorPins::flushSteps();
+	return isShaping();
+}
+
+bool MotionControl::isShaping() const
+{
+	for (auto& a : actuators) {
+		if(a.isShaping()) return true;
+	}
+	return false;
+}
+
+// Carries on after a feed hold has come to a stop, the rest of the held block (which is still at the tail of the queue)
+// and the blocks after it are replanned from rest, and the held block is started again.
+// returns false if it has not stopped yet, or if the held block had no steps left, then the next block has been replanned
+// from rest instead and the executer releases the held block and carries on with it
+bool MotionControl::resume()
+{
+	if(!holding) {
+		hold_requested= false;
+		return false;
+	}
+	for (auto& a : actuators) {
+		if(a.isMoving()) return false;
+	}
+
+	Planner& planner= THEKERNEL.getPlanner();
+	Block *block= planner.getQueue().getTail();
+	hold_requested= false;
+	holding= false;
+	hold_speed= 0;
+	if(block == nullptr) return false;
+
+	uint32_t steps_left[MAX_AXES];
+	for (size_t i = 0; i < actuators.size(); ++i) {
+		steps_left[i]= block->steps_to_move[i] == 0 ? 0 : actuators[i].getStepsLeft();
+	}
+	if(!planner.replanFromRest(*block, steps_left, actuators.size())) return false;
+	return issueMove(*block);
+}
+
 void MotionControl::issueUnsteps()
 {
 	// unstep any previous step
 	for (auto& a : actuators) {
 	 	a.unstep();
 	}
+	ActuatorPins::flushUnsteps();
 }
 
 Actuator& MotionControl::getActuator(char axis)
@@ -12,7 +12,6 @@
 #include "GCode.h"
 #include "MotionControl.h"
 #include "Actuator.h"
-#include "Lock.h"
 
 #include <math.h>
 #include <algorithm>
@@ -20,6 +19,7 @@
 #include <tuple>
 #include <iostream>
 #include <string.h>
+#include <bitset>
 
 Planner::Planner()
 {
@@ -42,6 +42,7 @@ void Planner::initialize()
 	// M codes
 	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 204, std::bind( &Planner::handleConfigurations, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 205, std::bind( &Planner::handleConfigurations, this, _1) );
+	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 566, std::bind( &Planner::handleConfigurations, this, _1) );
 	THEDISPATCHER.addHandler( Dispatcher::MCODE_HANDLER, 500, std::bind( &Planner::handleSaveConfiguration, this, _1) );
 }
 
@@ -50,7 +51,7 @@ void Planner::initialize()
 bool Planner::isSoloMove(const Block& block, char axis)
 {
 	uint8_t ai= THEKERNEL.getMotionControl().getAxisActuator(axis);
-	for (size_t i = 0; i < block.steps_to_move.size(); ++i) {
+	for (size_t i = 0; i < MAX_AXES; ++i) {
 		if(block.steps_to_move[i] != 0 && i != ai) {
 			return false;
 		}
@@ -58,22 +59,43 @@ bool Planner::isSoloMove(const Block& block, char axis)
 	return true;
 }
 
+// The junction speed allowed by the per axis instantaneous speed change limits (M566), each axis changes speed by
+// junction_speed * the change in its component of the unit vector, so the axis closest to its limit sets the speed.
+// An axis whose component does not change is not limited at all, so an X only reversal on a cartesian is only limited by X.
+// Returns 0 if any axis that changes has no limit set, so the junction deviation is used instead.
+float Planner::axisJunctionSpeed(const float *unit_vec, int n_axis, const Actuator *actuators) const
+{
+	float v = INFINITY;
+	for (int i = 0; i < n_axis; ++i) {
+		float dv = fabsf(unit_vec[i] - previous_unit_vec[i]);
+		if(dv < 0.0001F) continue;
+		float msc = actuators[i].getMaxSpeedChange();
+		if(msc <= 0.0F) return 0.0F;
+		v = std::min(v, msc / dv);
+	}
+	return v;
+}
+
 static uint32_t id = 0;
-bool Planner::plan(const float *last_target, const float *target, int n_axis,  Actuator *actuators, float rate_mms)
+// last_target and target are cartesian, for kinematics that are not linear the actuator positions for target are given too
+bool Planner::plan(const float *last_target, const float *target, int n_axis,  Actuator *actuators, float rate_mms, const float *actuator_target)
 {
 	//printf("last_target: %f,%f,%f target: %f,%f,%f rate: %f\n", last_target[0], last_target[1], last_target[2], target[0], target[1], target[2], rate_mms);
 
+	const MotionControl& mc = THEKERNEL.getMotionControl();
 	float deltas[n_axis];
+	bool primary[n_axis];
 	float distance = 0.0F;
 	float sos = 0.0F;
 	bool move = false;
 	for (int i = 0; i < n_axis; ++i) {
 		deltas[i] = target[i] - last_target[i];
+		primary[i] = mc.isPrimaryAxis(i);
 		if(deltas[i] == 0) {
 			continue;
 		}
 		move = true;
-		if(THEKERNEL.getMotionControl().isPrimaryAxis(i)) {
+		if(primary[i]) {
 			sos += powf(deltas[i], 2);
 		}
 	}
@@ -93,14 +115,13 @@ bool Planner::plan(const float *last_target, const float *target, int n_axis,  A
 		auxilliary_move= true;
 	}
 
-	// this is a HACK FIXME we need to be able to handle n axis properly
-	uint8_t xaxis = THEKERNEL.getMotionControl().getAxisActuator('X');
-	uint8_t yaxis = THEKERNEL.getMotionControl().getAxisActuator('Y');
-	uint8_t zaxis = THEKERNEL.getMotionControl().getAxisActuator('Z');
-	// uint8_t eaxis = THEKERNEL.getMotionControl().getAxisActuator('E');
-
-	// TODO what if we have 4 primary axis? does this become unit_vec[4]?
-	float unit_vec[3] {deltas[xaxis] / distance, deltas[yaxis] / distance, deltas[zaxis] / distance};
+	// the direction of the move in the primary axis, the other axis are left at 0 so they play no part in the junctions
+	float unit_vec[MAX_AXES] {};
+	bool has_unit_vec = false;
+	for (int i = 0; i < n_axis; ++i) {
+		if(primary[i]) unit_vec[i] = deltas[i] / distance;
+		if(previous_unit_vec[i] != 0.0F) has_unit_vec = true;
+	}
 
 	// use default acceleration to start with
 	float acceleration = default_acceleration;
@@ -108,18 +129,21 @@ bool Planner::plan(const float *last_target, const float *target, int n_axis,  A
 	// Do not move faster than the configured max speed for any axis
 	// downgrade the speed to make it right
 	// also check the acceleration against the axis acceleration, and downgrade if needed
+	float speed_limit = INFINITY;
 	for (int i = 0; i < n_axis; ++i) {
-		if(deltas[i] == 0) continue;
-		// adjust speed
-		float max_speed = actuators[i].getMaxSpeed(); // in mm/sec
-		float axis_speed = fabsf((deltas[i]/distance) * rate_mms);
-		if (axis_speed > max_speed) {
-			rate_mms *= ( max_speed / axis_speed );
+		// the actuator moves this far, when the kinematics are not linear it is not how far the cartesian axis moves
+		float axis_distance = fabsf(deltas[i]);
+		if(actuator_target != nullptr && primary[i]) {
+			axis_distance = fabsf(actuator_target[i] - actuators[i].steps2mm(actuators[i].getLastMilestoneSteps()));
 		}
+		if(axis_distance == 0) continue;
+		// the fastest this axis lets the move go
+		float max_speed = actuators[i].getMaxSpeed(); // in mm/sec
+		speed_limit = std::min(speed_limit, max_speed * distance / axis_distance);
 		// adjust acceleration
 		float ma =  actuators[i].getAcceleration(); // in mm/sec²
 		if(ma > 0.0F) {  // if axis does not have acceleration set then it uses the default_acceleration
-			float ca = fabsf((deltas[i]/distance) * acceleration);
+			float ca = (axis_distance / distance) * acceleration;
 			if (ca > ma) {
 				acceleration *= ( ma / ca );
 			}
@@ -130,17 +154,25 @@ bool Planner::plan(const float *last_target, const float *target, int n_axis,  A
 	Block block;
 	block.id = id++;
 
-	block.acceleration = acceleration; // save acceleration in block
+	// the S curve peaks at 15/8 times its average acceleration, so its ramps are planned at 8/15 of the acceleration to keep
+	// the peak within it, they take 1.875 times as long
+	block.s_curve = s_curve_acceleration;
+	block.acceleration = block.s_curve ? acceleration * (8.0F / 15.0F) : acceleration; // save acceleration in block
+
+	// the speed override (M220) is applied here so it can be changed for the blocks in the queue too
+	block.requested_speed = rate_mms;
+	block.speed_limit = speed_limit;
+	rate_mms = std::min(rate_mms * speed_override, speed_limit);
 
 	// set direction and steps to move for each axis
 	for (int i = 0; i < n_axis; i++) {
-		std::tuple<bool, uint32_t> r = actuators[i].stepsToTarget(target[i]);
-		block.direction.push_back(std::get<0>(r));
-		block.steps_to_move.push_back(std::get<1>(r));
+		std::tuple<bool, uint32_t> r = actuators[i].stepsToTarget(actuator_target != nullptr ? actuator_target[i] : target[i]);
+		block.setDirection(i, std::get<0>(r));
+		block.steps_to_move[i]= std::get<1>(r);
 	}
 
 	// Max number of steps, for all axis
-	auto mi= std::max_element(block.steps_to_move.begin(), block.steps_to_move.end());
+	auto mi= std::max_element(&block.steps_to_move[0], &block.steps_to_move[n_axis]);
 	block.steps_event_count = *mi;
 
 	block.millimeters = distance;
@@ -149,6 +181,9 @@ bool Planner::plan(const float *last_target, const float *target, int n_axis,  A
 	block.nominal_speed = rate_mms;
 	block.nominal_rate = (block.steps_event_count * rate_mms) / distance;
 
+	// until the trapezoid is calculated the best guess at how long it takes is at the nominal speed
+	block.queued_ticks = lroundf(distance / rate_mms * STEP_TICKER_FREQUENCY);
+
 	// default junction deviation
 	float junction_deviation = this->junction_deviation;
 
@@ -163,7 +198,8 @@ bool Planner::plan(const float *last_target, const float *target, int n_axis,  A
 
 	// FIXME junction deviation is not a good way to handle junctions, look at third order and blended moves
 	float vmax_junction = minimum_planner_speed; // Set default max junction speed
-	if(!auxilliary_move && junction_deviation > 0.0F && (previous_unit_vec[0] != 0.0F || previous_unit_vec[1] != 0.0F || previous_unit_vec[2] != 0.0F)) {
+	block.max_junction_speed = vmax_junction;
+	if(!auxilliary_move && junction_deviation > 0.0F && has_unit_vec) {
 		// if the primary axis do not move then treat it as if it always starts at 0
 		// if the previous_unit_vec is all zeroes also start at 0
 		// So if this move is a retract, or the previous was a retract then we will start at 0 speed
@@ -181,25 +217,34 @@ bool Planner::plan(const float *last_target, const float *target, int n_axis,  A
 
 		// NOTE however it does not take into account independent axis, in most cartesian X and Y and Z are totally independent
 		// and this allows one to stop with little to no decleration in many cases. This is particularly bad on leadscrew based systems that will skip steps.
+		// Setting the per axis speed change limits with M566 lets each axis take the junction as fast as it can on its own.
 
 		// FIXME I don't think this works we really need to get it from the head of the queue, but it last move was not a primary axis move then it needs to be 0
 		if (previous_nominal_speed > 0.0F) {
 			// Compute cosine of angle between previous and current path. (previous_unit_vec is negative)
 			// NOTE: Max junction velocity is computed without sin() or acos() by trig half angle identity.
-			float cos_theta = - previous_unit_vec[0] * unit_vec[0]
-							  - previous_unit_vec[1] * unit_vec[1]
-							  - previous_unit_vec[2] * unit_vec[2] ;
+			float cos_theta = 0.0F;
+			for (int i = 0; i < n_axis; ++i) {
+				cos_theta -= previous_unit_vec[i] * unit_vec[i];
+			}
 
 			// Skip and use default max junction speed for 0 degree acute junction.
 			if (cos_theta < 0.95F) {
-				vmax_junction = std::min(previous_nominal_speed, block.nominal_speed);
+				vmax_junction = INFINITY;
 				// Skip and avoid divide by zero for straight junctions at 180 degrees. Limit to min() of nominal speeds.
 				if (cos_theta > -0.95F) {
 					// Compute maximum junction velocity based on maximum acceleration and junction deviation
 					float sin_theta_d2 = sqrtf(0.5F * (1.0F - cos_theta)); // Trig half angle identity. Always positive.
-					vmax_junction = std::min(vmax_junction, sqrtf(acceleration * junction_deviation * sin_theta_d2 / (1.0F - sin_theta_d2)));
+					vmax_junction = sqrtf(acceleration * junction_deviation * sin_theta_d2 / (1.0F - sin_theta_d2));
 				}
 			}
+
+			// use the per axis limits instead if they allow a faster junction
+			vmax_junction = std::max(vmax_junction, axisJunctionSpeed(unit_vec, n_axis, actuators));
+
+			// kept without the nominal speeds so it can be redone when the speed override changes
+			block.max_junction_speed = vmax_junction;
+			vmax_junction = std::min(vmax_junction, std::min(previous_nominal_speed, block.nominal_speed));
 		}
 	}
 
@@ -209,7 +254,7 @@ bool Planner::plan(const float *last_target, const float *target, int n_axis,  A
 	block.max_entry_speed = vmax_junction;
 
 	// Initialize block entry speed. Compute based on deceleration to user-defined minimum_planner_speed.
-	float v_allowable = maxAllowableSpeed(-acceleration, minimum_planner_speed, block.millimeters);
+	float v_allowable = maxAllowableSpeed(-block.acceleration, minimum_planner_speed, block.millimeters);
 	block.entry_speed = std::min(vmax_junction, v_allowable);
 
 	// Initialize planner efficiency flags
@@ -222,54 +267,29 @@ bool Planner::plan(const float *last_target, const float *target, int n_axis,  A
 	// the maximum junction speed and may always be ignored for any speed reduction checks.
 	block.nominal_length_flag = (block.nominal_speed <= v_allowable);
 
-	// Always calculate trapezoid for new block
-	block.recalculate_flag = true;
-
 	// Update previous path unit_vector and nominal speed
 	memcpy(previous_unit_vec, unit_vec, sizeof(previous_unit_vec)); // previous_unit_vec[] = unit_vec[]
 
-	// stick on the head/front of the block queue
-	lookahead_q.push_front(block);
+	// wait for the block executer to free up a slot
+	while(queue.full()) {
+		// make sure the oldest blocks can be executed
+		if(queue.readySize() == 0) makeReady(queue.next(queue.getReadyIndex()));
+		THEKERNEL.delay(1);
+	}
+
+	// if there is nothing left in the lookahead then the previous block (if any) has already been
+	// planned to stop, so this block has to start from the minimum planner speed
+	if(queue.lookaheadSize() == 0) {
+		block.entry_speed = minimum_planner_speed;
+	}
+
+	// stick on the head of the block queue
+	queue.getHead()= block;
+	queue.pushHead();
 
-	// Math-heavy re-computing of the whole queue to take the new
+	// re-compute the part of the queue that can still change, and hand the rest to the block executer
 	recalculate();
 
-#if 0
-	// starting at end of the queue move any block that has recalculate_flag set to false into the ready queue
-	auto curi = lookahead_q.rbegin();
-	auto lasti= std::prev(lookahead_q.rend());
-	while(curi != lasti && !curi->recalculate_flag) {
-		// if this one has recalculate flag false then move this one to ready queue
-		auto nexti= std::next(curi);
-		Lock l(READY_Q_MUTEX); // gets a mutex on this
-		l.lock();
-		ready_q.push_front(*curi);
-		l.unlock();
-		lookahead_q.pop_back();
-		curi= nexti;
-	}
-#else
-	// to get around innacurate recalc flag settings search from head to first !recalc then copy subsequent ones to ready q
-	auto curi = lookahead_q.begin();
-	while(curi != lookahead_q.end()) {
-		if(!curi->recalculate_flag){
-			break;
-		}
-		curi= std::next(curi);
-	}
-	if(curi != lookahead_q.end()){
-		auto foundi= curi;
-		Lock l(READY_Q_MUTEX); // gets a mutex on this
-		l.lock();
-		auto ri= std::prev(lookahead_q.end());
-		while(ri != foundi) {
-			ready_q.push_front(*ri);
-			ri= std::prev(ri);
-		}
-		l.unlock();
-		lookahead_q.erase(std::next(foundi), lookahead_q.end());
-	}
-#endif
 	return true;
 }
 
@@ -280,20 +300,8 @@ float Planner::maxAllowableSpeed(float acceleration, float target_velocity, floa
 	return sqrtf(target_velocity * target_velocity - 2.0F * acceleration * distance);
 }
 
-float Planner::maxExitSpeed(const Block &b) const
-{
-	// if nominal_length_flag is asserted
-	// we are guaranteed to reach nominal speed regardless of entry speed
-	// thus, max exit will always be nominal
-	if (b.nominal_length_flag) return b.nominal_speed;
-
-	// otherwise, we have to work out max exit speed based on entry and acceleration
-	float max = maxAllowableSpeed(-b.acceleration, b.entry_speed, b.millimeters);
-
-	return std::min(max, b.nominal_speed);
-}
-
-// Called by Planner::recalculate() when scanning the plan from head to tail.
+// Called by Planner::recalculate() when scanning the plan from newest to oldest.
+// returns the entry speed of this block which is the exit speed of the previous block
 float Planner::reversePass(Block &b, float exit_speed)
 {
 	// If entry speed is already at the maximum entry speed, no need to recheck. Block is cruising.
@@ -314,108 +322,104 @@ float Planner::reversePass(Block &b, float exit_speed)
 	return b.entry_speed;
 }
 
-// Called by Planner::recalculate() when scanning the plan from tail to head.
-// returns maximum exit speed of this block
-float Planner::forwardPass(Block &b, float prev_max_exit_speed)
+// Called by Planner::recalculate() when scanning the plan from oldest to newest.
+// limits the entry speed of b to what the previous block can accelerate to
+// returns true if the entry speed of b can no longer be improved
+bool Planner::forwardPass(const Block &prev, Block &b)
 {
 	// If the previous block is an acceleration block, but it is not long enough to complete the
 	// full speed change within the block, we need to adjust the entry speed accordingly. Entry
 	// speeds have already been reset, maximized, and reverse planned by reverse planner.
-	// If nominal length is true, max junction speed is guaranteed to be reached. No need to recheck.
-
-	// TODO: find out if both of these checks are necessary
-	if (prev_max_exit_speed > b.nominal_speed) prev_max_exit_speed = b.nominal_speed;
-	if (prev_max_exit_speed > b.max_entry_speed) prev_max_exit_speed = b.max_entry_speed;
-
-	if (prev_max_exit_speed <= b.entry_speed) {
-		// accel limited
-		b.entry_speed = prev_max_exit_speed;
-		// since we're now acceleration or cruise limited
-		// we don't need to recalculate our entry speed anymore
-		b.recalculate_flag = false;
-		//std::cout << "recalculate_flag set to false: " << b.id << "\n";
+	if (prev.entry_speed < b.entry_speed) {
+		float max_exit_speed = maxAllowableSpeed(-prev.acceleration, prev.entry_speed, prev.millimeters);
+		if (max_exit_speed < b.entry_speed) {
+			// accel limited, so this is as fast as we can ever enter this block
+			b.entry_speed = max_exit_speed;
+			return true;
+		}
 	}
-	// else
-	// // decel limited, do nothing
 
-	return maxExitSpeed(b);
+	// if we are at the maximum junction speed adding more blocks can't make it any faster
+	return b.entry_speed == b.max_entry_speed;
 }
 
 /*
- * a newly added block is decel limited
- *
- * we find its max entry speed given its exit speed
- *
- * for each block, walking backwards in the queue:
+ * Based on the optimal plan pointer from grbl
+ * https://github.com/grbl/grbl/blob/master/grbl/planner.c
  *
- * if max entry speed == current entry speed
- * then we can set recalculate to false, since clearly adding another block didn't allow us to enter faster
- * and thus we don't need to check entry speed for this block any more
+ * The block at the ready index of the queue (the oldest block in the lookahead) is the planned block,
+ * its entry speed is optimal and can no longer change, so none of the blocks before it can change either.
  *
- * once we find an accel limited block, we must find the max exit speed and walk the queue forwards
+ * The newest block is always planned to decelerate to the minimum planner speed.
  *
- * for each block, walking forwards in the queue:
+ * Reverse pass: walking from the newest block back to the planned block, each block gets the maximum
+ * entry speed it can have and still decelerate to the entry speed of the following block.
  *
- * given the exit speed of the previous block and our own max entry speed
- * we can tell if we're accel or decel limited (or coasting)
+ * Forward pass: walking from the planned block to the newest block, each entry speed is limited to what
+ * the previous block can accelerate to. If a block is acceleration limited or reaches its maximum entry
+ * speed then adding more blocks will never make it faster, so the planned pointer moves up to it.
  *
- * if prev_exit > max_entry
- *     then we're still decel limited. update previous trapezoid with our max entry for prev exit
- * if max_entry >= prev_exit
- *     then we're accel limited. set recalculate to false, work out max exit speed
- *
- * finally, work out trapezoid for the final (and newest) block.
+ * Finally all the blocks behind the planned pointer are handed to the block executer, so each pass only
+ * touches the blocks that can still change. Only entry speeds are maintained here, the trapezoids are
+ * calculated by makeReady() as each block is handed over.
  */
 void Planner::recalculate()
 {
-	/*
-	 * Step 1:
-	 * For each block, given the exit speed and acceleration, find the maximum entry speed
-	 */
-
-	float entry_speed = minimum_planner_speed;
-	auto curi = lookahead_q.begin();
-	auto lasti = std::prev(lookahead_q.end()); // iterator pointing to last entry in queue
-
-	if (lookahead_q.size() > 1) {
-		// from head to tail
-		while(curi != lasti && curi->recalculate_flag) {
-			entry_speed = reversePass(*curi, entry_speed);
-			curi = std::next(curi);
+	size_t planned = queue.getReadyIndex(); // the oldest block in the lookahead
+	size_t newest = queue.prev(queue.getHeadIndex()); // index of the newest block in the queue
+
+	if(newest != planned) {
+		/*
+		 * Step 1:
+		 * reverse pass from the newest block to the planned block, which can't change
+		 */
+		float exit_speed = reversePass(queue[newest], minimum_planner_speed);
+		for (size_t i = queue.prev(newest); i != planned; i = queue.prev(i)) {
+			exit_speed = reversePass(queue[i], exit_speed);
 		}
 
 		/*
 		 * Step 2:
-		 * now current points to either the tail (back) of the queue or first non-recalculate block
-		 * and has not had its reverse_pass called
-		 * or its calc trap
-		 * entry_speed is set to the *exit* speed of current.
-		 * each block from current to head has its entry speed set to its max entry speed- limited by decel or nominal_rate
+		 * forward pass from the planned block to the newest block, moving the planned pointer up
+		 * as we find blocks that are optimally planned
 		 */
-
-		float exit_speed = maxExitSpeed(*curi);
-		while (curi != lookahead_q.begin()) {
-			auto previ = curi;
-			curi = std::prev(curi);
-
-			// we pass the exit speed of the previous block
-			// so this block can decide if it's accel or decel limited and update its fields as appropriate
-			exit_speed = forwardPass(*curi, exit_speed);
-
-			// now do a trapezoid calculation for the previous block, using this blocks entry speed for its exit speed
-			calculateTrapezoid(*previ, previ->entry_speed, curi->entry_speed);
+		for (size_t i = planned; i != newest; ) {
+			size_t n = queue.next(i);
+			if(forwardPass(queue[i], queue[n])) {
+				planned = n;
+			}
+			i = n;
 		}
+	}
+
+	// all the blocks behind the planned block can no longer change so hand them to the block executer
+	makeReady(planned);
+}
 
-	}else{
-		// first entry can't have its entry changed
-		curi->recalculate_flag= false;
+// calculates the trapezoids for the lookahead blocks upto but not including index upto and hands them to the block executer.
+// The trapezoids are only calculated once here when the entry and exit speeds can no longer change, rather than on every
+// recalculate(), the lookahead blocks only have their entry speeds maintained.
+void Planner::makeReady(size_t upto)
+{
+	size_t head = queue.getHeadIndex();
+	for (size_t i = queue.getReadyIndex(); i != upto; i = queue.next(i)) {
+		size_t n = queue.next(i);
+		// the newest block always exits at the minimum planner speed, otherwise use the next blocks entry speed
+		calculateTrapezoid(queue[i], queue[i].entry_speed, n == head ? minimum_planner_speed : queue[n].entry_speed);
+		queue.setQueuedTicks(queue[i], queue[i].total_move_ticks);
 	}
+	queue.setReadyIndex(upto);
+}
 
-	/*
-	 * Step 3:
-	 * work out trapezoid for final (and newest) block
-	 */
-	calculateTrapezoid(*curi, curi->entry_speed, minimum_planner_speed);
+// how much u goes up each tick of an S curve ramp of n ticks
+static scurve_t calculateSCurve(uint32_t n)
+{
+	if(n == 0) return 0;
+#ifdef STEP_FIXED_POINT
+	return (SCURVE_ONE + n / 2) / n;
+#else
+	return 1.0F / n;
+#endif
 }
 
 // this code written by Arthur Wolf based on his acceleration per tick work for Smoothie
@@ -514,32 +518,125 @@ void Planner::calculateTrapezoid(Block &block, float entryspeed, float exitspeed
 
 	block.initial_rate = initial_rate;
 	block.exit_speed = exitspeed;
+
+	// The S curve takes the same time over each ramp as the trapezoid and covers the same distance, so all the timings above
+	// still hold, but the acceleration and the jerk ramp up from zero and back down again, the acceleration peaking at 15/8
+	// times the trapezoids, which is why the block acceleration for an S curve is 8/15 of the acceleration asked for
+	if(block.s_curve) {
+		block.accelerate_step = calculateSCurve(acceleration_ticks);
+		block.decelerate_step = calculateSCurve(deceleration_ticks);
+	}
+
+#ifdef STEP_FIXED_POINT
+	// the integer step generator uses these, calculated in double so the rounding only happens once
+	block.initial_rate_fp = llround((double)initial_rate / STEP_TICKER_FREQUENCY * STEPRATE_ONE);
+	block.maximum_rate_fp = llround((double)block.maximum_rate / STEP_TICKER_FREQUENCY * STEPRATE_ONE);
+	block.acceleration_per_tick_fp = llround((double)acceleration_in_steps / STEP_TICKER_FREQUENCY_2 * STEPRATE_ONE);
+	block.deceleration_per_tick_fp = llround((double)deceleration_in_steps / STEP_TICKER_FREQUENCY_2 * STEPRATE_ONE);
+#endif
+}
+
+// M220 changes the speed of the blocks already queued as well as the new ones, the ready blocks that have not started
+// are taken back into the lookahead and replanned at the new speed. The executing block and the one after it are left
+// alone so the block executer never runs out, MotionControl re-ramps those two to the new speed as they run.
+void Planner::setSpeedOverride(float factor)
+{
+	speed_override = factor;
+
+	size_t planned = queue.reclaim(2);
+	size_t head = queue.getHeadIndex();
+	for (size_t i = planned; i != head; i = queue.next(i)) {
+		Block& b = queue[i];
+		b.nominal_speed = getOverriddenSpeed(b);
+		float v_allowable = maxAllowableSpeed(-b.acceleration, minimum_planner_speed, b.millimeters);
+		if(i == planned) {
+			// its entry speed can not change any more, so it has to be able to run at least that fast
+			b.nominal_speed = std::max(b.nominal_speed, b.entry_speed);
+		} else {
+			b.max_entry_speed = std::min(b.max_junction_speed, std::min(queue[queue.prev(i)].nominal_speed, b.nominal_speed));
+			b.entry_speed = std::min(b.max_entry_speed, v_allowable);
+		}
+		b.nominal_rate = (b.steps_event_count * b.nominal_speed) / b.millimeters;
+		b.nominal_length_flag = (b.nominal_speed <= v_allowable);
+		queue.setQueuedTicks(b, lroundf(b.millimeters / b.nominal_speed * STEP_TICKER_FREQUENCY));
+	}
+
+	if(planned != head) {
+		if(previous_nominal_speed > 0.0F) previous_nominal_speed = queue[queue.prev(head)].nominal_speed;
+		recalculate();
+	}
+}
+
+// after a feed hold the executing block (at the tail) is cut down to the steps it has left and starts from rest,
+// the blocks after it are taken back into the lookahead and replanned to follow on from it
+// NOTE the block executer must be stopped, returns false if there are no steps left, then the block after it starts from
+// rest instead as the executer will release the held block
+bool Planner::replanFromRest(Block& block, const uint32_t *steps_left, int n_axis)
+{
+	auto mi = std::max_element(steps_left, steps_left + n_axis);
+	if(*mi == 0) {
+		size_t next = queue.next(queue.getTailIndex());
+		if(next == queue.getHeadIndex()) return false;
+		queue[next].entry_speed = minimum_planner_speed;
+		queue.reclaim(1);
+		recalculate();
+		if(queue.getReadyIndex() == next) makeReady(queue.next(next));
+		return false;
+	}
+
+	block.millimeters *= (float)*mi / block.steps_event_count;
+	std::copy(steps_left, steps_left + n_axis, block.steps_to_move);
+	block.steps_event_count = *mi;
+	block.nominal_rate = (block.steps_event_count * block.nominal_speed) / block.millimeters;
+	block.entry_speed = minimum_planner_speed;
+
+	// the held block becomes the planned block with its entry speed fixed at rest
+	size_t tail = queue.getTailIndex();
+	queue.reclaim(0);
+	recalculate();
+	if(queue.getReadyIndex() == tail) makeReady(queue.next(tail));
+	return true;
 }
 
 void Planner::moveAllToReady()
 {
-	Lock l(READY_Q_MUTEX); // gets a mutex on this
-	l.lock();
-	while(!lookahead_q.empty()) {
-		ready_q.push_front(lookahead_q.back());
-		lookahead_q.pop_back();
+	makeReady(queue.getHeadIndex());
+}
+
+// used to hold up the incoming gcode when the queue has enough in it, measured by how long the queued moves will take
+// rather than the number of blocks, as a block can take anything from a few microseconds to minutes
+bool Planner::isQueueFull() const
+{
+	size_t n= queue.size();
+	if(n < MIN_QUEUE_BLOCKS) return false;
+	return n >= max_queue_blocks || getQueuedTime() >= max_queue_time;
+}
+
+// how long in seconds until all the queued blocks have been executed, the lookahead blocks are estimated at their nominal
+// speed, the ready blocks take the time of their trapezoids and the executing one has the ticks it has done taken off
+float Planner::getRemainingTime() const
+{
+	const MotionControl& mc = THEKERNEL.getMotionControl();
+	size_t tail = queue.getTailIndex();
+	const Block *executing = mc.getExecutingBlock();
+	uint32_t elapsed = mc.getElapsedTicks();
+	uint32_t ticks = queue.queuedTicks();
+	if(queue.size() > 0 && executing == &queue[tail]) {
+		ticks -= std::min(elapsed, std::min(executing->queued_ticks, ticks));
 	}
-	l.unlock();
+	return ticks / STEP_TICKER_FREQUENCY;
 }
 
+// NOTE the block executer must be stopped before calling this
 void Planner::purge()
 {
-	Lock l(READY_Q_MUTEX); // gets a mutex on this
-	l.lock();
-	lookahead_q.clear();
-	ready_q.clear();
-	l.unlock();
+	queue.clear();
 	reset();
 }
 
 bool Planner::handleSaveConfiguration(GCode &gc)
 {
-	gc.getOS().printf("M204 S%1.4f ", default_acceleration);
+	gc.getOS().printf("M204 S%1.4f J%d ", default_acceleration, s_curve_acceleration ? 1 : 0);
 	for(auto& a : THEKERNEL.getMotionControl().getActuators()) {
 		float acc= a.getAcceleration();
 		if(acc > 0.0F) {
@@ -548,17 +645,31 @@ bool Planner::handleSaveConfiguration(GCode &gc)
 	}
 	gc.getOS().printf("\n");
 
-	gc.getOS().printf("M205 S%1.4f X%1.4f Z%1.4f\n", minimum_planner_speed, junction_deviation, z_junction_deviation);
+	bool speed_change= false;
+	for(auto& a : THEKERNEL.getMotionControl().getActuators()) {
+		float msc= a.getMaxSpeedChange();
+		if(msc > 0.0F) {
+			if(!speed_change) gc.getOS().printf("M566 ");
+			gc.getOS().printf("%c%1.4f ", a.getAxis(), msc);
+			speed_change= true;
+		}
+	}
+	if(speed_change) gc.getOS().printf("\n");
+
+	gc.getOS().printf("M205 S%1.4f X%1.4f Z%1.4f T%1.4f B%d\n", minimum_planner_speed, junction_deviation, z_junction_deviation, max_queue_time, max_queue_blocks);
 	return true;
 }
 
 bool Planner::handleConfigurations(GCode &gc)
 {
 	switch(gc.getCode()) {
-		case 204: // M204 Snnn - set default acceleration to nnn, Xnnn sets X acceleration, ... , Znnn sets z acceleration etc
+		case 204: // M204 Snnn - set default acceleration to nnn, Xnnn sets X acceleration, ... , Znnn sets z acceleration etc, J1 jerk limited S curve acceleration J0 trapezoid
 			if (gc.hasArg('S')) {
 				default_acceleration = gc.getArg('S');
 			}
+			if (gc.hasArg('J')) {
+				s_curve_acceleration = gc.getArg('J') != 0;
+			}
 			for(auto& a : THEKERNEL.getMotionControl().getActuators()) {
 				char axis= a.getAxis();
 				if(gc.hasArg(axis)){
@@ -568,7 +679,13 @@ bool Planner::handleConfigurations(GCode &gc)
 
 			break;
 
-		case 205:  // M205 Xnnn - set junction deviation, Z - set Z junction deviation, S - Minimum planner speed
+		case 205:  // M205 Xnnn - set junction deviation, Z - set Z junction deviation, S - Minimum planner speed, T - seconds of moves to queue, B - max blocks to queue
+			if (gc.hasArg('T')) {
+				max_queue_time = gc.getArg('T');
+			}
+			if (gc.hasArg('B')) {
+				max_queue_blocks = std::min((size_t)gc.getArg('B'), queue.capacity());
+			}
 			if (gc.hasArg('S')) {
 				minimum_planner_speed = gc.getArg('S');
 			}
@@ -580,6 +697,16 @@ bool Planner::handleConfigurations(GCode &gc)
 			}
 			break;
 
+		case 566: // M566 Xnnn Ynnn ... - set the speed in mm/sec each axis can change by instantly at a junction, junctions use
+		          // these when all the axes that change have one set and it is faster than the junction deviation, 0 disables
+			for(auto& a : THEKERNEL.getMotionControl().getActuators()) {
+				char axis= a.getAxis();
+				if(gc.hasArg(axis)){
+					a.setMaxSpeedChange(gc.getArg(axis));
+				}
+			}
+			break;
+
 		default: return false;
 	}
 
@@ -591,9 +718,13 @@ bool Planner::handleConfigurations(GCode &gc)
 void Planner::dump(std::ostream &o) const
 {
 	for (int i = 0; i < 2; ++i) {
-		Queue_t q = i == 0 ? lookahead_q : ready_q;
-		o << (i == 0 ? "Look ahead Queue: " : "Ready Queue: ") << q.size() << " \n";
-		for(auto &b : q) {
+		// dump from newest to oldest
+		size_t start= i == 0 ? queue.getHeadIndex() : queue.getReadyIndex();
+		size_t end= i == 0 ? queue.getReadyIndex() : queue.getTailIndex();
+		o << (i == 0 ? "Look ahead Queue: " : "Ready Queue: ") << ((start - end) & (BLOCK_QUEUE_SIZE - 1)) << " \n";
+		for(size_t j = start; j != end; ) {
+			j= queue.prev(j);
+			const Block& b= queue[j];
 			o <<
 			  "Id: " << b.id                         << ", " <<
 			  "accelerate_until: " <<  b.accelerate_until          << ", " <<
@@ -612,8 +743,7 @@ void Planner::dump(std::ostream &o) const
 			  "max_entry_speed: " <<  b.max_entry_speed           << ", " <<
 			  "entry_speed: " <<  b.entry_speed               << ", " <<
 			  "exit_speed: " <<  b.exit_speed                << ", " <<
-			  "recalculate_flag: " <<  b.recalculate_flag   << "," <<
-			  "direction: " <<  b.direction                 << "," <<
+			  "direction: " <<  std::bitset<MAX_AXES>(b.direction) << "," <<
 			  "steps_to_move: " << b.steps_to_move << "\n";
 		}
 	}
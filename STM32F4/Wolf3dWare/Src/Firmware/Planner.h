@@ -1,13 +1,25 @@
 #pragma once
 
 #include "Block.h"
+#include "BlockQueue.h"
+#include "Actuator.h"
 
 #include <stdint.h>
-#include <deque>
+#include <algorithm>
+#include <ostream>
+
+// number of blocks the planner queue can hold, must be a power of 2
+#ifndef BLOCK_QUEUE_SIZE
+#define BLOCK_QUEUE_SIZE 128
+#endif
+
+// the queue always gets at least this many blocks whatever time they take, so long moves still have some lookahead
+#ifndef MIN_QUEUE_BLOCKS
+#define MIN_QUEUE_BLOCKS 8
+#endif
 
 class GCode;
 class MotionControl;
-class Actuator;
 
 class Planner
 {
@@ -16,35 +28,47 @@ public:
 	~Planner(){};
 	void reset();
 	void initialize();
-	bool plan(const float *last_target, const float *target, int n_axis, Actuator *actuators, float rate_mms);
+	bool plan(const float *last_target, const float *target, int n_axis, Actuator *actuators, float rate_mms, const float *actuator_target= nullptr);
 	void dump(std::ostream& o) const;
 	void purge();
 
-	using Queue_t = std::deque<Block>;
-	Queue_t& getLookAheadQueue() { return lookahead_q; }
-	Queue_t& getReadyQueue() { return ready_q; }
+	using Queue_t = BlockQueue<BLOCK_QUEUE_SIZE>;
+	Queue_t& getQueue() { return queue; }
 	void moveAllToReady();
+	bool isQueueFull() const;
+	float getQueuedTime() const { return queue.queuedTicks() / STEP_TICKER_FREQUENCY; }
+	float getRemainingTime() const;
+	void setSpeedOverride(float factor);
+	bool replanFromRest(Block& block, const uint32_t *steps_left, int n_axis);
+	float getSpeedOverride() const { return speed_override; }
+	// the speed a block should run at with the current speed override
+	float getOverriddenSpeed(const Block& b) const { return std::min(b.requested_speed * speed_override, b.speed_limit); }
 
 private:
 	void calculateTrapezoid(Block& block, float entryspeed, float exitspeed);
   	float maxAllowableSpeed( float acceleration, float target_velocity, float distance) const;
-	float maxExitSpeed(const Block& b) const;
 	float reversePass(Block &b, float exit_speed);
-	float forwardPass(Block &b, float prev_max_exit_speed);
+	bool forwardPass(const Block &prev, Block &b);
     void recalculate();
+	void makeReady(size_t upto);
 	bool isSoloMove(const Block& block, char axis);
+	float axisJunctionSpeed(const float *unit_vec, int n_axis, const Actuator *actuators) const;
 
 	bool handleConfigurations(GCode&);
 	bool handleSaveConfiguration(GCode &gc);
 
-	Queue_t lookahead_q;
-	Queue_t ready_q;
+	// lookahead and ready blocks share the one queue
+	Queue_t queue;
 
-    float previous_unit_vec[3];
+    float previous_unit_vec[MAX_AXES];
 	float previous_nominal_speed{0};
 
     float default_acceleration{2000};
     float junction_deviation{0.05F};
     float z_junction_deviation{-1};
     float minimum_planner_speed{0};
+    bool s_curve_acceleration{false};
+    float speed_override{1.0F}; // M220 as a factor
+    float max_queue_time{2.0F}; // seconds of moves to queue before the gcode stream is held up
+    uint16_t max_queue_blocks{BLOCK_QUEUE_SIZE - 8}; // and the most blocks
 };
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// most steps an actuator makes on one tick, the block, a Bresenham follower, pressure advance and the input shaper can
+// each step it
+#ifndef MAX_STEPS_PER_TICK
+#define MAX_STEPS_PER_TICK 4
+#endif
+
+/**
+	The steps a pin policy was told to make since they were last taken, and which way each went. The StepProducer takes
+	them every tick so it sees each step, even when an actuator steps twice or forward then back on one tick.
+	When nothing takes them the log just stays full.
+*/
+class StepLog
+{
+public:
+	void add(bool dir) { if(n < MAX_STEPS_PER_TICK) dirs[n++]= dir; }
+	// copies the steps into d and empties the log, returns how many there were
+	uint8_t take(bool *d)
+	{
+		uint8_t c= n;
+		for (uint8_t i = 0; i < c; ++i) d[i]= dirs[i];
+		n= 0;
+		return c;
+	}
+	void clear() { n= 0; }
+
+private:
+	bool dirs[MAX_STEPS_PER_TICK];
+	uint8_t n{0};
+};
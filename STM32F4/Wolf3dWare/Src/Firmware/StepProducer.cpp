@@ -0,0 +1,314 @@
+#include "StepProducer.h"
+#include "Kernel.h"
+#include "MotionControl.h"
+#include "Planner.h"
+#include "Actuator.h"
+
+#include <string.h>
+
+// the tick a step at time t is played on, the first one at or after it
+static inline uint64_t toTick(uint64_t t) { return (t + STEP_CHUNK_ONE - 1) >> STEP_CHUNK_FRACTION; }
+
+// true if stepping at interval then adding add each step plays the first count steps within MAX_STEP_ERROR of their ticks
+bool StepCompressor::fits(size_t count, uint32_t interval, int32_t add) const
+{
+	uint64_t t= last;
+	uint64_t prev= toTick(last);
+	int64_t iv= interval;
+	for (size_t i = 0; i < count; ++i) {
+		if(iv < 1) return false;
+		t += iv;
+		uint64_t tick= toTick(t);
+		// never two steps on the same tick
+		if(tick <= prev) return false;
+		int64_t e= (int64_t)(tick - times[i]);
+		if(e > MAX_STEP_ERROR || e < -MAX_STEP_ERROR) return false;
+		prev= tick;
+		iv += add;
+	}
+	return true;
+}
+
+// n / d rounded to the nearest, d is positive
+static inline int64_t divRound(int64_t n, int64_t d) { return (n >= 0 ? n + d / 2 : n - d / 2) / d; }
+
+// the interval and add of the chunk through the middle of the ticks the middle step and the last of the first count steps
+// were made on, step k is at last + k*interval + add*k*(k-1)/2. Done in integers as the FPU only has single precision and the
+// times need more than that. Returns true if it plays all count steps within MAX_STEP_ERROR of their ticks
+bool StepCompressor::fitRun(size_t count, uint32_t& interval, int32_t& add) const
+{
+	int64_t c= count, m= (count + 1) / 2;
+	int64_t yc= (int64_t)((times[c - 1] << STEP_CHUNK_FRACTION) - last) - STEP_CHUNK_ONE / 2;
+	int64_t ym= (int64_t)((times[m - 1] << STEP_CHUNK_FRACTION) - last) - STEP_CHUNK_ONE / 2;
+	int64_t a= divRound(2 * (m * yc - c * ym), m * c * (c - m));
+	if(a < INT16_MIN || a > INT16_MAX) return false;
+	int64_t iv= divRound(yc - a * (c * (c - 1) / 2), c);
+	if(iv < 1 || iv > UINT32_MAX) return false;
+	if(!fits(count, iv, a)) return false;
+	interval= iv;
+	add= a;
+	return true;
+}
+
+bool StepCompressor::compress(StepChunkQueue& q)
+{
+	if(n == 0 || q.full()) return false;
+
+	// a step on its own is played on its tick, unless the last step was played late on that tick
+	uint64_t first= times[0] << STEP_CHUNK_FRACTION;
+	uint64_t prev= toTick(last);
+	if(times[0] <= prev) first= (prev + 1) << STEP_CHUNK_FRACTION;
+	uint64_t gap= first - last;
+	if(gap > UINT32_MAX) {
+		// not stepped for longer than an interval can hold, so wait out part of it with no steps
+		q.push({UINT32_MAX, 0, 0, dirs[0]});
+		last += UINT32_MAX;
+		return true;
+	}
+
+	// then the longest of the steps in the same direction that one interval and add fits, usually all of them do, if not
+	// it is found by bisection so it only takes a few fits whatever the run
+	size_t run= 1;
+	while(run < n && dirs[run] == dirs[0]) ++run;
+	uint32_t interval= gap;
+	size_t count= 1;
+	int32_t add= 0;
+	if(run > 1 && fitRun(run, interval, add)) {
+		count= run;
+	}else{
+		size_t hi= run; // the shortest run known not to fit
+		while(hi - count > 1) {
+			size_t c= (count + hi) / 2;
+			if(fitRun(c, interval, add)) count= c;
+			else hi= c;
+		}
+	}
+
+	q.push({interval, (uint16_t)count, (int16_t)add, dirs[0]});
+
+	// the next chunk carries on from where the last step of this one is played, which may not be where it was made
+	last += (uint64_t)count * interval + (int64_t)add * (int64_t)(count * (count - 1) / 2);
+	n -= count;
+	memmove(times, &times[count], n * sizeof(times[0]));
+	memmove(dirs, &dirs[count], n * sizeof(dirs[0]));
+	return true;
+}
+
+StepProducer::StepProducer()
+{
+	time= 0;
+	block_tick= 0;
+	chunks= steps= 0;
+	running= false;
+	held= false;
+	clear_requested= false;
+	clock= 0;
+}
+
+uint64_t StepProducer::getClock() const
+{
+	// the ISR may tick between reading the two halves, so read it until it is the same twice
+	uint64_t a, b;
+	do {
+		a= clock;
+		b= clock;
+	} while(a != b);
+	return a;
+}
+
+// compresses the steps of each actuator, if all is false it waits for a full set of steps so the chunks are as long as
+// they can be, unless the oldest is due soon. Returns true if steps are left that could not go as the queue is full
+bool StepProducer::compressAll(bool all)
+{
+	bool blocked= false;
+	for (size_t i = 0; i < MAX_AXES; ++i) {
+		StepCompressor& c= compressors[i];
+		while(!c.isEmpty() && (all || c.isFull() || c.getOldest() + STEP_CHUNK_AHEAD / 2 <= time)) {
+			if(!c.compress(queues[i])) break;
+			++chunks;
+		}
+		if(all ? !c.isEmpty() : c.isFull()) blocked= true;
+	}
+	return blocked;
+}
+
+// each step the actuators made on this tick is a step for the compressor, in the order they made them
+void StepProducer::record()
+{
+	std::vector<Actuator>& actuators= THEKERNEL.getMotionControl().getActuators();
+	bool dirs[MAX_STEPS_PER_TICK];
+	for (size_t i = 0; i < actuators.size(); ++i) {
+		uint8_t n= actuators[i].getPins().takeSteps(dirs);
+		for (uint8_t j = 0; j < n; ++j) {
+			compressors[i].push(time, dirs[j]);
+		}
+		steps += n;
+	}
+}
+
+// runs the step generator until it is STEP_CHUNK_AHEAD ticks ahead of the step ticker, a queue is full or there is
+// nothing left to do. Returns false once everything has been made into chunks
+bool StepProducer::fill()
+{
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+	for(;;) {
+		if(compressAll(false)) return true;
+
+		// stopped for a feed hold, the block stays at the tail until it is resumed. held is read first as resume()
+		// sets running before it clears held
+		if(held.load(std::memory_order_acquire)) {
+			compressAll(true);
+			return true;
+		}
+
+		Block *block= nullptr;
+		if(!running) {
+			// nothing more to make, so the last steps do not wait for a full set
+			block= q.getTail();
+			if(block == nullptr && !mc.isShaping()) return compressAll(true);
+		}
+
+		if((int64_t)(time - getClock()) >= STEP_CHUNK_AHEAD) return true;
+
+		if(!running) {
+			// nothing has been made for a while so start a little ahead of the step ticker
+			uint64_t start= getClock() + STEP_CHUNK_START;
+			if(time < start) time= start;
+
+			if(block == nullptr) {
+				// the input shapers carry on for a while after the last move has finished
+				mc.issueShaperTicks();
+				++time;
+				record();
+				continue;
+			}
+
+			// drop any steps logged while the producer was not running, they were never going to be played
+			bool dirs[MAX_STEPS_PER_TICK];
+			for (auto& a : mc.getActuators()) a.getPins().takeSteps(dirs);
+			block_tick= 0;
+			if(mc.issueMove(*block)) running.store(true, std::memory_order_release);
+			else q.releaseTail();
+			continue;
+		}
+
+		bool moves_left= mc.issueTicks(++block_tick);
+		++time;
+		record();
+		if(!moves_left) {
+			if(mc.isHolding()) held.store(true, std::memory_order_release);
+			else q.releaseTail();
+			running.store(false, std::memory_order_release);
+		}
+	}
+}
+
+// carries on after a feed hold, returns false until the producer has slowed down to a stop. Once it is held the
+// producer task leaves the block queue and MotionControl alone until held is cleared
+bool StepProducer::resume()
+{
+	if(!held.load(std::memory_order_acquire)) {
+		if(running.load(std::memory_order_acquire)) return false;
+		// nothing was held
+		THEKERNEL.getMotionControl().resume();
+		return true;
+	}
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	block_tick= 0;
+	// the hold may have stopped it on the last step of the block
+	if(mc.resume()) running.store(true, std::memory_order_release);
+	else q.releaseTail();
+	held.store(false, std::memory_order_release);
+	return true;
+}
+
+void StepProducer::clear()
+{
+	for (size_t i = 0; i < MAX_AXES; ++i) {
+		queues[i].clear();
+		compressors[i].clear();
+		players[i].next= 0;
+		players[i].count= 0;
+		players[i].gap= false;
+	}
+	clock= 0;
+	time= 0;
+	running= false;
+	held= false;
+	clear_requested.store(false, std::memory_order_release);
+}
+
+// plays the chunks for one tick, returns a bit for each actuator whose next step is due and sets a bit in dirs for each
+// that changes direction
+uint32_t StepProducer::play(uint32_t& dirs)
+{
+	uint64_t t= clock + 1;
+	clock= t;
+	uint32_t stepped= 0;
+	dirs= 0;
+	for (size_t i = 0; i < MAX_AXES; ++i) {
+		Player& p= players[i];
+		if(p.count == 0 && !p.gap) {
+			if(queues[i].empty()) continue;
+			const StepChunk& c= queues[i].front();
+			p.next += c.interval;
+			p.interval= c.interval;
+			p.add= c.add;
+			p.count= c.count;
+			p.gap= c.count == 0;
+			bool dir_changed= c.dir != p.dir;
+			queues[i].pop();
+			if(dir_changed && !p.gap) {
+				p.dir= !p.dir;
+				dirs |= 1 << i;
+				// the direction has to be set for a tick before the step, if the step was due on this tick it is late
+				if(toTick(p.next) <= t) continue;
+			}
+		}
+		if(toTick(p.next) > t) continue;
+
+		if(p.gap) {
+			p.gap= false;
+			continue;
+		}
+
+		stepped |= 1 << i;
+		if(--p.count > 0) {
+			p.interval += p.add;
+			p.next += p.interval;
+		}
+	}
+	return stepped;
+}
+
+// Runs in the step ticker ISR, steps each actuator whose next step is due, returns true if any did
+bool StepProducer::tick()
+{
+	uint32_t dirs;
+	uint32_t stepped= play(dirs);
+	for (size_t i = 0; (stepped | dirs) >> i != 0; ++i) {
+		Player& p= players[i];
+		if(dirs & (1 << i)) p.pins.setDir(p.dir);
+		if(stepped & (1 << i)) {
+			p.pins.setStep(true);
+			p.stepped= true;
+		}
+	}
+	if(stepped != 0) StepperPins::flushSteps();
+	return stepped != 0;
+}
+
+// Runs in the unstep ticker ISR
+void StepProducer::unstep()
+{
+	for (auto& p : players) {
+		if(p.stepped) {
+			p.pins.setStep(false);
+			p.stepped= false;
+		}
+	}
+	StepperPins::flushUnsteps();
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "Block.h"
+#include "StepperPins.h"
+#include "StepLog.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// how many chunks each actuator can have queued, must be a power of 2
+#ifndef STEP_CHUNK_QUEUE_SIZE
+#define STEP_CHUNK_QUEUE_SIZE 64
+#endif
+// how many steps the compressor holds to find the longest chunk
+#ifndef STEP_COMPRESS_STEPS
+#define STEP_COMPRESS_STEPS 64
+#endif
+// how many ticks a step played from a chunk can be off from the tick the step generator made it on
+#ifndef MAX_STEP_ERROR
+#define MAX_STEP_ERROR 1
+#endif
+// how far ahead of the step ticker the producer runs, 100ms, this is also how long a feed hold takes to start
+#ifndef STEP_CHUNK_AHEAD
+#define STEP_CHUNK_AHEAD 10000
+#endif
+// when it starts from idle the first step is at least this far ahead of the step ticker, 1ms
+#ifndef STEP_CHUNK_START
+#define STEP_CHUNK_START 100
+#endif
+
+// the chunk times are in 1/256ths of a tick, so steps at a rate that is not a whole number of ticks still make long chunks
+#define STEP_CHUNK_FRACTION 8
+#define STEP_CHUNK_ONE (1 << STEP_CHUNK_FRACTION)
+
+// a run of steps in one direction, the first is interval after the last step of the previous chunk and the interval
+// changes by add after each step, each step is played on the first tick at or after its time.
+// A chunk with no steps is a gap too long for one interval.
+struct StepChunk
+{
+	uint32_t interval;
+	uint16_t count;
+	int16_t add;
+	bool dir;
+};
+
+// chunks for one actuator, thread safe for a single producer and a single consumer, the step ticker ISR
+class StepChunkQueue
+{
+public:
+	static_assert((STEP_CHUNK_QUEUE_SIZE & (STEP_CHUNK_QUEUE_SIZE - 1)) == 0, "STEP_CHUNK_QUEUE_SIZE must be a power of 2");
+
+	StepChunkQueue() : tail(0), head(0) {}
+
+	// Producer side
+	bool full() const { return next(head.load(std::memory_order_relaxed)) == tail.load(std::memory_order_acquire); }
+	void push(const StepChunk& c)
+	{
+		size_t h= head.load(std::memory_order_relaxed);
+		ring[h]= c;
+		head.store(next(h), std::memory_order_release);
+	}
+
+	// Consumer side, front() is only valid if not empty()
+	bool empty() const { return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire); }
+	const StepChunk& front() const { return ring[tail.load(std::memory_order_relaxed)]; }
+	void pop() { tail.store(next(tail.load(std::memory_order_relaxed)), std::memory_order_release); }
+
+	// NOTE only safe to call when the consumer is not running
+	void clear() { tail.store(0); head.store(0); }
+
+private:
+	static size_t next(size_t n) { return (n + 1) & (STEP_CHUNK_QUEUE_SIZE - 1); }
+
+	StepChunk ring[STEP_CHUNK_QUEUE_SIZE];
+	std::atomic<size_t> tail;
+	std::atomic<size_t> head;
+};
+
+// turns the ticks one actuator steps on into chunks
+class StepCompressor
+{
+public:
+	StepCompressor() : last(0), n(0) {}
+
+	// a step at tick t, only call if not isFull()
+	void push(uint64_t t, bool dir) { times[n]= t; dirs[n]= dir; ++n; }
+	// leaves room for all the steps an actuator can make on one tick
+	bool isFull() const { return n + MAX_STEPS_PER_TICK > STEP_COMPRESS_STEPS; }
+	bool isEmpty() const { return n == 0; }
+	uint64_t getOldest() const { return times[0]; }
+	// makes one chunk from the oldest steps, false if there were none or the queue is full
+	bool compress(StepChunkQueue& q);
+	// NOTE only when the queue has been cleared as well
+	void clear() { last= 0; n= 0; }
+
+private:
+	bool fits(size_t count, uint32_t interval, int32_t add) const;
+	bool fitRun(size_t count, uint32_t& interval, int32_t& add) const;
+
+	// the time the last chunk finished on, as it will be played
+	uint64_t last;
+	uint64_t times[STEP_COMPRESS_STEPS]; // the ticks the steps were made on
+	bool dirs[STEP_COMPRESS_STEPS];
+	size_t n;
+};
+
+/**
+	Runs the step generator outside of the step ticker ISR and leaves the steps in a queue of chunks for each actuator.
+
+	fill() is called from a high priority task, it takes the ready blocks from the block queue and ticks MotionControl
+	in its own time, upto STEP_CHUNK_AHEAD ticks ahead of the step ticker. The steps each actuator makes are compressed
+	into chunks of (interval, count, add) so most moves only need a few chunks.
+	tick() is all the step ticker ISR does, it plays the chunks and sets the step and direction pins, so how long a block
+	takes to set up no longer matters as long as the producer stays ahead.
+	The actuators still keep their positions, but they do not drive the step pins themselves, their pin policy logs each
+	step they make for the producer to take.
+*/
+class StepProducer
+{
+public:
+	StepProducer();
+
+	// Producer side
+	bool fill();
+	// NOTE only safe to call when the ISR is not playing the chunks, and from the task that calls fill()
+	void clear();
+
+	// these can be called from any thread, the producer task is told to clear as it may be part way through fill()
+	bool resume();
+	bool isIdle() const { return !running.load(std::memory_order_acquire) && !held.load(std::memory_order_acquire); }
+	bool isHeld() const { return held.load(std::memory_order_acquire); }
+	void requestClear() { clear_requested.store(true, std::memory_order_release); }
+	bool isClearRequested() const { return clear_requested.load(std::memory_order_acquire); }
+	uint32_t getChunkCount() const { return chunks; }
+	uint32_t getStepCount() const { return steps; }
+
+	// Runs in the step ticker ISR
+	bool tick();
+	void unstep();
+	// for an output stage that sets the pins itself
+	uint32_t play(uint32_t& dirs);
+	bool getDir(size_t i) const { return players[i].dir; }
+
+	StepperPins& getPins(size_t i) { return players[i].pins; }
+	// the ticks played so far
+	uint64_t getClock() const;
+
+private:
+	void record();
+	bool compressAll(bool all);
+
+	struct Player
+	{
+		StepperPins pins;
+		uint64_t next{0};    // the time of the next step, or the end of the gap, or the last step if the chunk is done
+		uint32_t interval{0};
+		int16_t add{0};
+		uint16_t count{0};   // steps left in the chunk
+		bool gap{false};     // waiting out a chunk with no steps
+		bool dir{false};
+		bool stepped{false};
+	};
+
+	StepChunkQueue queues[MAX_AXES];
+	StepCompressor compressors[MAX_AXES];
+
+	// producer side
+	uint64_t time;
+	uint32_t block_tick;
+	uint32_t chunks, steps;
+	// running is only set by the producer task, held is only cleared by resume(), each is set before the other is
+	// cleared so it is never idle part way between the two
+	std::atomic<bool> running;
+	std::atomic<bool> held;
+	std::atomic<bool> clear_requested;
+
+	// ISR side
+	Player players[MAX_AXES];
+	volatile uint64_t clock;
+};
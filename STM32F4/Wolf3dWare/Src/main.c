@@ -106,6 +106,9 @@ static void mainThread(void const *argument);
 static void SystemClock_Config(void);
 static void Error_Handler(void);
 static void Timer_Config(void);
+#ifdef STEP_DMA
+static void StepDMA_Config(void);
+#endif
 
 TIM_HandleTypeDef PerformanceTimHandle;
 TIM_HandleTypeDef StepTickerTimHandle;
@@ -661,6 +664,36 @@ static void Timer_Config()
 		 + ClockDivision = 0
 		 + Counter direction = Up
 	*/
+#if defined(STEP_DMA)
+	// the step and direction pins are written by DMA, there is no step ticker interrupt
+	StepDMA_Config();
+#elif defined(STEP_EVENT_TIMER)
+	// free running at 1us a count, the channel 1 compare interrupts on the next tick anything has to be done on
+	StepTickerTimHandle.Init.Period = 0xFFFF;
+	StepTickerTimHandle.Init.Prescaler = uwPrescalerValue;
+	StepTickerTimHandle.Init.ClockDivision = 0;
+	StepTickerTimHandle.Init.CounterMode = TIM_COUNTERMODE_UP;
+
+	if(HAL_TIM_OC_Init(&StepTickerTimHandle) != HAL_OK) {
+		/* Initialization Error */
+		Error_Handler();
+	}
+
+	TIM_OC_InitTypeDef sConfig;
+	sConfig.OCMode = TIM_OCMODE_TIMING;
+	sConfig.Pulse = 10 - 1;
+	sConfig.OCPolarity = TIM_OCPOLARITY_HIGH;
+	sConfig.OCFastMode = TIM_OCFAST_DISABLE;
+	if(HAL_TIM_OC_ConfigChannel(&StepTickerTimHandle, &sConfig, TIM_CHANNEL_1) != HAL_OK) {
+		/* Configuration Error */
+		Error_Handler();
+	}
+
+	if(HAL_TIM_OC_Start_IT(&StepTickerTimHandle, TIM_CHANNEL_1) != HAL_OK) {
+		/* Starting Error */
+		Error_Handler();
+	}
+#else
 	StepTickerTimHandle.Init.Period = 10 - 1; // set period to trigger interrupt at 10us or 100KHz
 	StepTickerTimHandle.Init.Prescaler = uwPrescalerValue;
 	StepTickerTimHandle.Init.ClockDivision = 0;
@@ -677,6 +710,7 @@ static void Timer_Config()
 		/* Starting Error */
 		Error_Handler();
 	}
+#endif
 
 	// setup the unstepticker timer interrupt
 
@@ -699,6 +733,110 @@ static void Timer_Config()
 
 }
 
+#ifdef STEP_DMA
+extern GPIO_TypeDef *getStepPort(int);
+extern uint32_t *getStepBuffer(int);
+extern uint32_t getStepBufferSize(void);
+extern uint32_t getStepWordRate(void);
+extern void renderSteps(int);
+
+// TIM1 requests a word from each stream in turn, only DMA2 can write to the GPIO ports. One stream for each of the
+// STEP_RENDER_PORTS, these requests are all on channel 6 and miss the stream the ADC uses
+static TIM_HandleTypeDef StepDMATimHandle;
+static DMA_HandleTypeDef StepDMAHandles[4];
+static DMA_Stream_TypeDef * const step_dma_streams[4]= { DMA2_Stream5, DMA2_Stream3, DMA2_Stream2, DMA2_Stream6 };
+static const uint32_t step_dma_requests[4]= { TIM_DMA_UPDATE, TIM_DMA_CC1, TIM_DMA_CC2, TIM_DMA_CC3 };
+
+static void StepDMAHalfComplete(DMA_HandleTypeDef *hdma) { renderSteps(0); }
+static void StepDMAComplete(DMA_HandleTypeDef *hdma) { renderSteps(1); }
+
+void DMA2_Stream5_IRQHandler(void)
+{
+	HAL_DMA_IRQHandler(&StepDMAHandles[0]);
+}
+
+// one DMA stream for each port writes its buffer of BSRR words to the port, the update stream interrupts when each half
+// of the buffers has been written to render the next steps into it
+static void StepDMA_Config()
+{
+	__HAL_RCC_TIM1_CLK_ENABLE();
+	__HAL_RCC_DMA2_CLK_ENABLE();
+
+	// TIM1 is clocked at SystemCoreClock, it runs at STEP_RENDER_SLOTS times the step ticker rate
+	StepDMATimHandle.Instance = TIM1;
+	StepDMATimHandle.Init.Period = SystemCoreClock / getStepWordRate() - 1;
+	StepDMATimHandle.Init.Prescaler = 0;
+	StepDMATimHandle.Init.ClockDivision = 0;
+	StepDMATimHandle.Init.CounterMode = TIM_COUNTERMODE_UP;
+	StepDMATimHandle.Init.RepetitionCounter = 0;
+	if(HAL_TIM_OC_Init(&StepDMATimHandle) != HAL_OK) {
+		Error_Handler();
+	}
+
+	// the compares all match at the start of each period so every stream writes its word at the same time
+	TIM_OC_InitTypeDef sConfig;
+	sConfig.OCMode = TIM_OCMODE_TIMING;
+	sConfig.Pulse = 0;
+	sConfig.OCPolarity = TIM_OCPOLARITY_HIGH;
+	sConfig.OCNPolarity = TIM_OCNPOLARITY_HIGH;
+	sConfig.OCFastMode = TIM_OCFAST_DISABLE;
+	sConfig.OCIdleState = TIM_OCIDLESTATE_RESET;
+	sConfig.OCNIdleState = TIM_OCNIDLESTATE_RESET;
+	const uint32_t channels[3]= { TIM_CHANNEL_1, TIM_CHANNEL_2, TIM_CHANNEL_3 };
+	for (int i = 0; i < 3; ++i) {
+		if(HAL_TIM_OC_ConfigChannel(&StepDMATimHandle, &sConfig, channels[i]) != HAL_OK) {
+			Error_Handler();
+		}
+	}
+
+	// both halves are rendered before the first word is written
+	renderSteps(0);
+	renderSteps(1);
+
+	for (int i = 0; i < 4; ++i) {
+		GPIO_TypeDef *port= getStepPort(i);
+		if(port == NULL) break;
+
+		DMA_HandleTypeDef *hdma= &StepDMAHandles[i];
+		hdma->Instance = step_dma_streams[i];
+		hdma->Init.Channel = DMA_CHANNEL_6;
+		hdma->Init.Direction = DMA_MEMORY_TO_PERIPH;
+		hdma->Init.PeriphInc = DMA_PINC_DISABLE;
+		hdma->Init.MemInc = DMA_MINC_ENABLE;
+		hdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+		hdma->Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+		hdma->Init.Mode = DMA_CIRCULAR;
+		hdma->Init.Priority = DMA_PRIORITY_VERY_HIGH;
+		hdma->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+		hdma->Init.FIFOThreshold = DMA_FIFO_THRESHOLD_HALFFULL;
+		hdma->Init.MemBurst = DMA_MBURST_SINGLE;
+		hdma->Init.PeriphBurst = DMA_PBURST_SINGLE;
+		if(HAL_DMA_Init(hdma) != HAL_OK) {
+			Error_Handler();
+		}
+
+		HAL_StatusTypeDef r;
+		if(i == 0) {
+			hdma->XferHalfCpltCallback = StepDMAHalfComplete;
+			hdma->XferCpltCallback = StepDMAComplete;
+			r= HAL_DMA_Start_IT(hdma, (uint32_t)getStepBuffer(i), (uint32_t)&port->BSRR, getStepBufferSize());
+		}else{
+			r= HAL_DMA_Start(hdma, (uint32_t)getStepBuffer(i), (uint32_t)&port->BSRR, getStepBufferSize());
+		}
+		if(r != HAL_OK) {
+			Error_Handler();
+		}
+		__HAL_TIM_ENABLE_DMA(&StepDMATimHandle, step_dma_requests[i]);
+	}
+
+	// same priority as the step ticker
+	HAL_NVIC_SetPriority(DMA2_Stream5_IRQn, 0x05, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Stream5_IRQn);
+
+	__HAL_TIM_ENABLE(&StepDMATimHandle);
+}
+#endif
+
 // pins defined for these functions set in maincpp.cpp
 extern uint16_t xendstop, yendstop, zendstop;
 /**
@@ -758,6 +896,36 @@ void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
 	}
 }
 
+#ifdef STEP_EVENT_TIMER
+extern uint32_t getTickDelay(void);
+/**
+  * @brief  Output compare callback, the event scheduled step ticker
+  * @param  htim: TIM handle
+  * @retval None
+  */
+void HAL_TIM_OC_DelayElapsedCallback(TIM_HandleTypeDef *htim)
+{
+	if(htim->Instance == STEPTICKER_TIMx) {
+		xst= start_time();
+		bool moves_left= issueTicks();
+
+		// move the compare on to the next tick that has to be issued, a tick is 10 counts. If that has already gone by
+		// because this took too long it interrupts again straight away
+		uint16_t next= __HAL_TIM_GET_COMPARE(htim, TIM_CHANNEL_1) + getTickDelay() * 10;
+		uint16_t now= __HAL_TIM_GET_COUNTER(htim);
+		if((int16_t)(next - now) <= 0) next= now + 1;
+		__HAL_TIM_SET_COMPARE(htim, TIM_CHANNEL_1, next);
+
+		if(!moves_left) {
+			// signal the next block to start, handled in moveCompletedThread
+			BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+			vTaskNotifyGiveFromISR( moveCompletedThreadHandle, &xHigherPriorityTaskWoken );
+			portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+		}
+	}
+}
+#endif
+
 // this will start the unstep ticker
 void startUnstepTicker()
 {
@@ -6,6 +6,8 @@
 #include "Firmware/Block.h"
 #include "Firmware/Planner.h"
 #include "Firmware/Actuator.h"
+#include "Firmware/StepProducer.h"
+#include "Firmware/StepRenderer.h"
 
 #include "Lock.h"
 #include "GPIO.h"
@@ -22,6 +24,7 @@
 #include <malloc.h>
 #include <string.h>
 #include <algorithm>
+#include <deque>
 
 using namespace std;
 
@@ -41,7 +44,6 @@ static StatusScreen *pstatus_screen;
 #endif
 
 // global
-SemaphoreHandle_t READY_Q_MUTEX;
 SemaphoreHandle_t TEMPERATURE_MUTEX;
 
 uint32_t xdelta= 0;
@@ -62,8 +64,44 @@ volatile bool running= false;
 
 static size_t maxqsize= 0;
 
+#ifdef STEP_CHUNKS
+// makes the steps into chunks in moveCompletedThread, the step ticker only plays them
+static StepProducer step_producer;
+#endif
+
+
 #define __debugbreak()  { __asm volatile ("bkpt #0"); }
 
+#ifdef STEP_DMA
+// renders the chunks into a buffer of BSRR words for each port, DMA writes them to the ports so nothing steps in an ISR
+static StepRenderer step_renderer(step_producer);
+static GPIO_TypeDef *step_ports[STEP_RENDER_PORTS];
+
+// the buffer a port is rendered into
+static uint8_t stepPortIndex(uint32_t port)
+{
+	for (uint8_t i = 0; i < STEP_RENDER_PORTS; ++i) {
+		if(step_ports[i] == nullptr) step_ports[i]= (GPIO_TypeDef *)port;
+		if(step_ports[i] == (GPIO_TypeDef *)port) return i;
+	}
+	// more ports than there are buffers for
+	__debugbreak();
+	return 0;
+}
+
+extern "C" GPIO_TypeDef *getStepPort(int i) { return step_ports[i]; }
+extern "C" uint32_t *getStepBuffer(int i) { return step_renderer.getBuffer(i); }
+extern "C" uint32_t getStepBufferSize() { return StepRenderer::BUFFER_SIZE; }
+extern "C" uint32_t getStepWordRate() { return STEP_TICKER_FREQUENCY * STEP_RENDER_SLOTS; }
+
+// called from the DMA interrupt when half the buffers have been written
+extern "C" void renderSteps(int half)
+{
+	if(execute_mode) step_renderer.render(half);
+	else step_renderer.clear(half);
+}
+#endif
+
 
 // define specific pins, set 3rd parameter to true if inverted
 static const bool INVERTPIN=false;
@@ -307,6 +345,30 @@ static void initializePins()
 	TriggerPin::output(false);
 }
 
+// the step words for each port, written once a tick by the step and unstep ISRs
+GPIO_TypeDef *StepPorts::ports[STEP_PORTS];
+uint32_t StepPorts::step_words[STEP_PORTS];
+uint32_t StepPorts::unstep_words[STEP_PORTS];
+uint8_t StepPorts::n= 0;
+
+template <class TStep, class TDir, class TEnb>
+static void assignPins(char axis)
+{
+	MotionControl& mc= THEKERNEL.getMotionControl();
+#if defined(STEP_DMA)
+	// the DMA drives the step and direction pins, the actuator just the enable
+	mc.getActuator(axis).getPins().pins.assign<TStep, TDir, TEnb>();
+	step_renderer.assign(mc.getAxisActuator(axis), stepPortIndex(TStep::Port), TStep::Pin, TStep::Inverted,
+		stepPortIndex(TDir::Port), TDir::Pin, TDir::Inverted);
+#elif defined(STEP_CHUNKS)
+	// the step producer drives the step and direction pins, the actuator just the enable
+	mc.getActuator(axis).getPins().pins.assign<TStep, TDir, TEnb>();
+	step_producer.getPins(mc.getAxisActuator(axis)).assign<TStep, TDir, TEnb>();
+#else
+	mc.getActuator(axis).getPins().assign<TStep, TDir, TEnb>();
+#endif
+}
+
 extern "C" void getPosition(float *x, float *y, float *z, float *e)
 {
 	*x= THEKERNEL.getMotionControl().getActuator('X').getCurrentPositionInmm();
@@ -350,7 +412,6 @@ static uint16_t readADC()
 
 extern "C" int maincpp()
 {
-	READY_Q_MUTEX= xSemaphoreCreateMutex();
 	TEMPERATURE_MUTEX= xSemaphoreCreateMutex();
 
 	// creates Kernel singleton and other singletons and Initializes MotionControl
@@ -371,18 +432,10 @@ extern "C" int maincpp()
 	initializePins();
 
 	// Setup pins for each Actuator
-	mc.getActuator('X').assignHALFunction(Actuator::SET_STEP, [](bool on)  { X_StepPin::set(on); });
-	mc.getActuator('X').assignHALFunction(Actuator::SET_DIR, [](bool on)   { X_DirPin::set(on); });
-	mc.getActuator('X').assignHALFunction(Actuator::SET_ENABLE, [](bool on){ X_EnbPin::set(on); });
-	mc.getActuator('Y').assignHALFunction(Actuator::SET_STEP, [](bool on)  { Y_StepPin::set(on); });
-	mc.getActuator('Y').assignHALFunction(Actuator::SET_DIR, [](bool on)   { Y_DirPin::set(on); });
-	mc.getActuator('Y').assignHALFunction(Actuator::SET_ENABLE, [](bool on){ Y_EnbPin::set(on); });
-	mc.getActuator('Z').assignHALFunction(Actuator::SET_STEP, [](bool on)  { Z_StepPin::set(on); });
-	mc.getActuator('Z').assignHALFunction(Actuator::SET_DIR, [](bool on)   { Z_DirPin::set(on); });
-	mc.getActuator('Z').assignHALFunction(Actuator::SET_ENABLE, [](bool on){ Z_EnbPin::set(on); });
-	mc.getActuator('E').assignHALFunction(Actuator::SET_STEP, [](bool on)  { E_StepPin::set(on); });
-	mc.getActuator('E').assignHALFunction(Actuator::SET_DIR, [](bool on)   { E_DirPin::set(on); });
-	mc.getActuator('E').assignHALFunction(Actuator::SET_ENABLE, [](bool on){ E_EnbPin::set(on);  });
+	assignPins<X_StepPin, X_DirPin, X_EnbPin>('X');
+	assignPins<Y_StepPin, Y_DirPin, Y_EnbPin>('Y');
+	assignPins<Z_StepPin, Z_DirPin, Z_EnbPin>('Z');
+	assignPins<E_StepPin, E_DirPin, E_EnbPin>('E');
 
 #ifdef PRINTER3D
 	// needed for hotend
@@ -448,22 +501,28 @@ extern "C" void stage2_setup()
 	#endif
 }
 
+// we are the only consumer of the block queue so it needs no locking
 void executeNextBlock()
 {
-	// queue needs to be protected with a Mutex
-	Planner::Queue_t& q= THEKERNEL.getPlanner().getReadyQueue();
-	Lock l(READY_Q_MUTEX);
-	l.lock();
-	if(!q.empty()) {
-		Block block= q.back(); // incurs a copy as we destroy it in next instruction
-		q.pop_back();
-		l.unlock();
-		// sets up the move with all the actuators involved in this block
-		move_issued= THEKERNEL.getMotionControl().issueMove(block);
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+	if(THEKERNEL.getMotionControl().isHolding()) {
+		// stopped part way through the block for a feed hold, it stays at the tail until it is resumed
+		move_issued= false;
+		return;
+	}
+
+	if(running) {
+		// we have finished with the block that was executing so its slot can be reused
+		q.releaseTail();
+	}
+
+	Block *block= q.getTail();
+	if(block != nullptr) {
+		// sets up the move with all the actuators involved in this block, it is executed in place
+		move_issued= THEKERNEL.getMotionControl().issueMove(*block);
 		running= true;
 
 	}else{
-		l.unlock();
 		running= false;
 	}
 	#ifdef USE_STM32F429I_DISCO
@@ -550,17 +609,45 @@ bool handleCommand(const char *line)
 		#endif
 
 	}else if(strcmp(line, "run") == 0) {
+		THEKERNEL.getMotionControl().flushMoves();
 		THEKERNEL.getPlanner().moveAllToReady();
-		executeNextBlock();
+		MotionControl& mc= THEKERNEL.getMotionControl();
+		mc.cancelHold();
+#ifdef STEP_CHUNKS
+		if(mc.isHolding()) {
+			// wait for the producer to finish slowing down then carry on with the rest of the held block,
+			// it picks up the ready blocks itself
+			while(!step_producer.resume()) THEKERNEL.delay(1);
+			THEKERNEL.getPlanner().moveAllToReady();
+		}
+#else
+		if(mc.isHolding()) {
+			// wait for it to finish slowing down then carry on with the rest of the held block
+			while(move_issued) THEKERNEL.delay(1);
+			move_issued= mc.resume();
+			if(!move_issued) executeNextBlock();
+
+		}else if(!running) {
+			// don't release the executing block if it is still running
+			executeNextBlock();
+		}
+#endif
 		execute_mode= true;
 		oss << "ok\n";
 
 	}else if(strcmp(line, "hold") == 0) {
-		execute_mode= false;
+		// decelerate to a stop, run resumes
+		THEKERNEL.getMotionControl().feedHold();
 		oss << "ok\n";
 
 	}else if(strcmp(line, "kill") == 0) {
 		execute_mode= false;
+		#ifdef STEP_CHUNKS
+		// the step ticker stops playing the chunks when not in execute mode, the producer task may be part way through
+		// making them so it clears them itself, and has stopped using the queue once it has
+		step_producer.requestClear();
+		while(step_producer.isClearRequested()) THEKERNEL.delay(1);
+		#endif
 		THEKERNEL.getPlanner().purge();
 		THEKERNEL.getMotionControl().resetAxisPositions();
 		running= false;
@@ -570,7 +657,11 @@ bool handleCommand(const char *line)
 		oss << "Worst time: " << xdelta << "uS\n";
 		oss << "worst overflow: " << overflow << " ticks\n";
 		oss << "max q size: " << maxqsize << "\n";
+		oss << "queued: " << THEKERNEL.getPlanner().getRemainingTime() << "s in " << THEKERNEL.getPlanner().getQueue().size() << " blocks\n";
 		oss << "kicked lq, rq: " << lq_kicked << ", " << rq_kicked << "\n";
+		#ifdef STEP_CHUNKS
+		oss << "step chunks: " << step_producer.getChunkCount() << " for " << step_producer.getStepCount() << " steps\n";
+		#endif
 		oss << "ok\n";
 
 	}else if(strcmp(line, "mem") == 0) {
@@ -617,27 +708,37 @@ bool handleCommand(const char *line)
 // we have not recieved any commands for a while see if we can kickstart the queue running
 extern "C" void kickQueue()
 {
+#ifdef STEP_CHUNKS
+	// the producer takes the ready blocks itself, it just needs the lookahead made ready when nothing else will
+	if(execute_mode && step_producer.isIdle()) {
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+		if(q.readySize() > 0) return;
+		THEKERNEL.getMotionControl().flushMoves();
+		if(q.lookaheadSize() > 0) {
+			THEKERNEL.getPlanner().moveAllToReady();
+			lq_kicked++;
+		}
+	}
+#else
 	if(execute_mode && !running) {
-		Planner::Queue_t& q= THEKERNEL.getPlanner().getReadyQueue();
-		Lock l(READY_Q_MUTEX);
-		l.lock();
-		size_t n=  q.size();
-		l.unlock();
-		if(n > 0) {
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+		if(q.readySize() > 0) {
 			// we have somethign in the queue we can execute
 			executeNextBlock();
 			rq_kicked++;
 			return;
 		}
-		// check lookahead queue, no need to lock it as it is only manipulated in this thread
-		Planner::Queue_t& lq= THEKERNEL.getPlanner().getLookAheadQueue();
-		if(lq.size() > 0) {
+		// nothing is running so the line held back for G64 blending can go to the planner
+		THEKERNEL.getMotionControl().flushMoves();
+		// check lookahead queue, it is only manipulated in this thread
+		if(q.lookaheadSize() > 0) {
 			// move it into ready and execute it (probably a single jog command)
 			THEKERNEL.getPlanner().moveAllToReady();
 			executeNextBlock();
 			lq_kicked++;
 		}
 	}
+#endif
 }
 
 // gets called for each received line from USB serial port
@@ -696,28 +797,21 @@ extern "C" bool commandLineHandler(const char *line)
 		}
 	}
 
-	// check for large queue size, stall until it gets smaller
-	const size_t MAX_Q= 100;
-	Planner::Queue_t& q= THEKERNEL.getPlanner().getReadyQueue();
-	Lock l(READY_Q_MUTEX);
-	l.lock();
-	size_t n= q.size() + THEKERNEL.getPlanner().getLookAheadQueue().size();
-	l.unlock();
+	// check if the queue holds enough time (or blocks), stall until some of it has been executed (set by M205 T and B)
+	Planner& planner= THEKERNEL.getPlanner();
+	size_t n= planner.getQueue().size();
 	if(n > maxqsize) maxqsize= n;
 
-	if(n > MAX_Q) {
+	if(planner.isQueueFull()) {
 		// we force it to start executing and if not currently running we start off the first block
 		if(!execute_mode) execute_mode= true;
 
-		// wait for some free space in the queue
+		// wait for some of the queue to be executed
 		do{
 			// we may need to kick it in case the lookahead is full and ready is empty which can happen in certain cases
 			kickQueue();
-			THEKERNEL.delay(100);
-			l.lock();
-			n= q.size() + THEKERNEL.getPlanner().getLookAheadQueue().size();
-			l.unlock();
-		} while(n > MAX_Q-4);
+			THEKERNEL.delay(10);
+		} while(planner.isQueueFull());
 	}
 	return true;
 }
@@ -725,18 +819,77 @@ extern "C" bool commandLineHandler(const char *line)
 
 extern uint32_t xst, xet;
 extern "C" uint32_t stop_time();
+
+#ifdef STEP_EVENT_TIMER
+// the step ticker is a timer compare that is set for the next tick anything has to be done on, this is how many ticks away that is
+static uint32_t tick_delay= 1;
+extern "C" uint32_t getTickDelay() { return tick_delay; }
+// when there is nothing to do it only looks for a new move every 1ms
+#define IDLE_TICK_DELAY 100
+#endif
+
+#ifdef STEP_CHUNKS
+// the steps were made into chunks ahead of time by moveCompletedThread, so all the step ticker does is play them,
+// there are no block changes in the ISR so no ticks can be missed
+extern "C" bool issueTicks()
+{
+#ifndef STEP_DMA
+	if(execute_mode && step_producer.tick()) startUnstepTicker();
+#endif
+	return true;
+}
+
+extern "C" void issueUnstep()
+{
+#ifndef STEP_DMA
+	step_producer.unstep();
+#endif
+}
+
+// keeps the chunks STEP_CHUNK_AHEAD ahead of the step ticker
+void moveCompletedThread(void const *argument)
+{
+	for(;;) {
+		if(step_producer.isClearRequested()) step_producer.clear();
+		else if(execute_mode) step_producer.fill();
+		THEKERNEL.delay(1);
+	}
+}
+
+#else
+
 // run ticks in tick ISR, but the pri needs to be 5 otherwise we can't use signals
 // worst case with 4 axis stepping is 8uS so far
 extern "C" bool issueTicks()
 {
 	static uint32_t current_tick= 0;
 	MotionControl& mc= THEKERNEL.getMotionControl();
+#ifdef STEP_EVENT_TIMER
+	tick_delay= 1;
+	if(!execute_mode) {
+		tick_delay= IDLE_TICK_DELAY;
+		return true;
+	}
+#else
 	if(!execute_mode) return true;
+#endif
 
 	// TODO need to count missed ticks while moveCompletedThread is running
 	if(!move_issued){
 		// nothing asked to move so we don't need to do anything
-		if(waiting_ticks > 0) waiting_ticks++; // this gets incremented if we are waiting for the next move to get setup
+		if(waiting_ticks > 0) {
+			waiting_ticks++; // this gets incremented if we are waiting for the next move to get setup
+
+		}else if(mc.isShaping()) {
+			// the input shapers carry on for a while after the last move has finished
+			mc.issueShaperTicks();
+			if(mc.isStepped()) startUnstepTicker();
+		}
+#ifdef STEP_EVENT_TIMER
+		else{
+			tick_delay= IDLE_TICK_DELAY;
+		}
+#endif
 		return true;
 	}
 	if(waiting_ticks > overflow) overflow= waiting_ticks;
@@ -761,6 +914,16 @@ extern "C" bool issueTicks()
 
 	bool all_moves_finished= !mc.issueTicks(++current_tick);
 
+#ifdef STEP_EVENT_TIMER
+	if(!all_moves_finished) {
+		// the ticks that nothing steps in are run now and the timer interrupts on the one after them
+		uint32_t n= mc.getIdleTicks(current_tick);
+		mc.skipTicks(n);
+		current_tick += n;
+		tick_delay= n + 1;
+	}
+#endif
+
 	if(mc.isStepped()) {
 		// if a step or steps were set then start the unstep ticker
 		startUnstepTicker();
@@ -807,6 +970,7 @@ void moveCompletedThread(void const *argument)
 		}
 	}
 }
+#endif // STEP_CHUNKS
 
 extern "C" void tests()
 {
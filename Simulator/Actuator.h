@@ -1,19 +1,27 @@
 #pragma once
 
 #include "Block.h"
+#include "InputShaper.h"
+#include "StepperPins.h"
+#include "StepLog.h"
 
 #include <stdint.h>
+#include <cmath>
 #include <tuple>
-#include <functional>
 
-class Actuator
+// TPins is the pin policy, it has setStep(bool), setDir(bool) and setEnable(bool) which are expanded inline
+// so a step is a direct port write rather than a call through a function pointer. The steps may be held until
+// the static flushSteps() and flushUnsteps() that MotionControl calls at the end of each tick and unstep
+template <class TPins>
+class ActuatorT
 {
 public:
-	Actuator(char axis) : axis(axis), moving(false), enabled(false) {};
-	~Actuator(){};
-	static void setCurrentBlock(const Block& block) { current_block= block; }
+	ActuatorT(char axis) : axis(axis), moving(false), enabled(false) {};
+	~ActuatorT(){};
+	// the block is executed in place so it must not be released until all actuators have finished with it
+	static void setCurrentBlock(const Block& block) { current_block= &block; }
 
-	void move( bool direction, uint32_t steps_to_move, float axis_ratio);
+	void move( bool direction, uint32_t steps_to_move, float axis_ratio, bool advance= false);
 	float mm2steps(float mm) const { return mm*steps_per_mm; }
 	float steps2mm(float steps) const { return steps/steps_per_mm; }
 	void setStepsPermm(float spmm) { steps_per_mm= spmm; }
@@ -23,55 +31,134 @@ public:
 	bool checkMaxSpeed();
 	void setAcceleration(float a) { acceleration= a; }
 	float getAcceleration() const { return acceleration; }
+	void setMaxSpeedChange(float v) { max_speed_change= v; }
+	float getMaxSpeedChange() const { return max_speed_change; }
 	void setScale(float sc) { scale= sc; }
 	float getScale() const { return scale; }
+	void setPressureAdvance(float k) { pressure_advance= k; advance_ticks= lroundf(k * STEP_TICKER_FREQUENCY); }
+	float getPressureAdvance() const { return pressure_advance; }
+	bool setInputShaper(InputShaper::TYPE type, float frequency, float damping);
+	// true if the input shaper can hold back the steps at the max speed, it is sized when it is set
+	bool checkInputShaper() const { return shaper == nullptr || shaper->fits(max_speed * steps_per_mm); }
+	const InputShaper *getInputShaper() const { return shaper; }
 
 	std::tuple<bool,uint32_t> stepsToTarget(float target);
 	bool tick(uint32_t current_tick, bool& stepped);
+	// event scheduled stepping, the ticks after current_tick it will not step in (or in 1/2^level steps) and skipping over them
+	uint32_t getIdleTicks(uint32_t current_tick, uint8_t level= 0) const;
+	void skipTicks(uint32_t n);
+	// when shaped the steps from tick() go through the input shaper, this takes the shaped steps and is called every tick even when not moving
+	bool shapeTick() { return shaper != nullptr && shapeStep(); }
+	bool isShaping() const { return shaper != nullptr && !shaper->isIdle(); }
+	void hold();
+	void hold(float speed);
+	void reramp(float speed);
+	uint32_t getStepsLeft() const { return steps_to_move - step_count; }
+	bool isMoving() const { return moving; }
+	// the rate it is stepping at on this tick in steps/sec
+	float getStepRate() const { return (float)steps_per_tick / STEPRATE_ONE * STEP_TICKER_FREQUENCY; }
+	bool isAdvancing() const { return advancing; }
+	// how far the move has got in 1/2^level steps, the Bresenham engine steps the axes that follow this one from it
+#ifdef STEP_FIXED_POINT
+	uint32_t getSubSteps(uint8_t level) const { return (step_count << level) + (uint32_t)((counter << level) >> 32); }
+#else
+	uint32_t getSubSteps(uint8_t level) const { return (step_count << level) + (uint32_t)(counter * (1 << level)); }
+#endif
+	// a follower is not ticked, it is only stepped by followStep() so it does not count as moving on its own
+	void follow() { moving= false; }
+	bool followStep();
 	char getAxis() const { return axis; }
 	uint32_t getCurrentPositionInSteps() const { return current_step_position; }
+	int32_t getLastMilestoneSteps() const { return last_milestone_steps; }
 	float getCurrentPositionInmm() const { return steps2mm(current_step_position); }
-	void resetPositionInmm(float mm) { current_step_position= last_milestone_steps= mm2steps(mm); }
-	void resetPositionInSteps(uint32_t s) { current_step_position= last_milestone_steps= s; }
+	void resetPositionInmm(float mm) { current_step_position= last_milestone_steps= mm2steps(mm); advance_steps= 0; if(shaper != nullptr) shaper->reset(); }
+	void resetPositionInSteps(uint32_t s) { current_step_position= last_milestone_steps= s; advance_steps= 0; if(shaper != nullptr) shaper->reset(); }
 	void enable(bool);
 	void unstep();
 
-	enum HAL_FUNCTION_INDEX
-	{
-		SET_STEP,
-		SET_DIR,
-		SET_ENABLE,
-		N_HAL_FUNCTIONS
-	};
-	using HAL_function_t = std::function<void(bool)>;
-	void assignHALFunction(HAL_FUNCTION_INDEX i, HAL_function_t fnc) { hal_functions[i] = fnc; }
+	TPins& getPins() { return pins; }
+	const TPins& getPins() const { return pins; }
 
 private:
 	void step();
+	void commandStep(bool dir);
+	bool shapeStep();
+	int32_t advanceWanted() const;
+	bool advanceStep(int32_t want);
+	void startSCurve(scurve_t step, steprate_t delta);
 
 	// configuration settings
 	float steps_per_mm;
 	float max_speed{500}; // mm/sec
 	float acceleration{0}; // mm/sec²
+	float max_speed_change{0}; // mm/sec the axis can change speed by instantly at a junction, 0 if not set
+	float pressure_advance{0}; // seconds, the extruder is pushed ahead by this times its speed
+	uint32_t advance_ticks{0}; // pressure_advance in ticks
 
 	// one static block for all the instances to share
-	static Block current_block;
-	float counter;
-	float acceleration_change;
+	static const Block *current_block;
+	// step rates for this actuator, in steps/tick (and steps/tick² for the acceleration)
+	steprate_t counter;
+	steprate_t acceleration_change;
+	steprate_t steps_per_tick;
+	steprate_t maximum_steps_per_tick;
+	steprate_t acceleration_per_tick;
+	steprate_t deceleration_per_tick;
+	// the S curve ramp being followed, steps_per_tick= ramp_start_rate + ramp_delta * s
+	steprate_t ramp_start_rate;
+	steprate_t ramp_delta;
+	// M220 re-ramps the executing block to this rate
+	steprate_t reramp_target;
+	scurve_t s_u, s_step;
 	uint32_t steps_to_move;
 	uint32_t step_count;
 	uint32_t next_accel_event;
-	float steps_per_tick;
-	float axis_ratio;
 	float scale{1.0F};
 	int32_t last_milestone_steps{0};
 	int32_t current_step_position{0};
-	HAL_function_t hal_functions[N_HAL_FUNCTIONS];
+	// pressure advance, how many steps the actuator is ahead of where the block puts it, the advance for this move
+	// and the advance it should have at the end of the move
+	int32_t advance_steps{0};
+	uint32_t move_advance_ticks{0};
+	int32_t exit_advance{0};
+	InputShaper *shaper{nullptr}; // created the first time a shaper is set, only used when there is one
+	TPins pins;
 	char axis;
 	struct {
 		bool direction:1;
+		bool dir_pin:1;
+		bool advancing:1;
+		bool advance_finishing:1;
 		bool moving: 1;
 		bool stepped:1;
 		bool enabled:1;
+		bool s_curve_ramp:1;
+		bool holding:1;
+		bool reramping:1;
 	};
 };
+
+#ifdef STEP_CHUNKS
+// the StepProducer plays the steps from its chunks and drives the step and direction pins, so the actuators only enable
+// and log the steps they make for it
+class EnablePins
+{
+public:
+	void setStep(bool on) { if(on) log.add(dir); }
+	void setDir(bool on) { dir= on; }
+	void setEnable(bool on) { pins.setEnable(on); }
+	static void flushSteps() {}
+	static void flushUnsteps() {}
+	uint8_t takeSteps(bool *dirs) { return log.take(dirs); }
+
+	StepperPins pins;
+	StepLog log;
+	bool dir{false};
+};
+using ActuatorPins = EnablePins;
+#else
+using ActuatorPins = StepperPins;
+#endif
+
+// the pin policy is picked by the build, the Simulator counts steps and the firmware writes the ports
+using Actuator = ActuatorT<ActuatorPins>;
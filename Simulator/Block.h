@@ -1,11 +1,38 @@
 #pragma once
 
-#include <bitset>
-#include <vector>
+#include <stdint.h>
+#include <type_traits>
 
 #define STEP_TICKER_FREQUENCY 100000.0F
 #define STEP_TICKER_FREQUENCY_2 (STEP_TICKER_FREQUENCY*STEP_TICKER_FREQUENCY)
 
+// define STEP_FIXED_POINT to build the integer step generator, the step rates and the step accumulator are then held as
+// 32.32 fixed point steps per tick instead of floats, which avoids the FPU in the step ticker ISR and its rounding errors
+#ifdef STEP_FIXED_POINT
+using steprate_t = int64_t;
+#define STEPRATE_ONE (1LL << 32)
+#else
+using steprate_t = float;
+#define STEPRATE_ONE 1.0F
+#endif
+
+// the S curve ramps follow the quintic s(u)= 10u³ - 15u⁴ + 6u⁵ as u goes from 0 to 1 over the n ticks of the ramp, it has
+// zero acceleration and zero jerk at both ends. u goes up by 1/n each tick and s is worked out from it, in the fixed point
+// build u is a 0.32 fixed point fraction
+#ifdef STEP_FIXED_POINT
+using scurve_t = uint64_t;
+#define SCURVE_ONE (1ULL << 32)
+#else
+using scurve_t = float;
+#define SCURVE_ONE 1.0F
+#endif
+
+// maximum number of actuators a Block can move, sizes the per axis arrays in the Block
+#ifndef MAX_AXES
+#define MAX_AXES 4
+#endif
+
+// NOTE must remain trivially copyable, no pointers or containers, so it can be copied without touching the heap
 struct Block {
 	uint32_t id{0};
 	uint32_t accelerate_until{0};
@@ -16,18 +43,42 @@ struct Block {
 	float maximum_rate {0};
 	float nominal_rate{0};
 	float nominal_speed{0};
+	float requested_speed{0}; // the speed asked for before the speed override and axis limits, nominal_speed is this with them
+	float speed_limit{0}; // the fastest the axis max speeds allow
 	float acceleration{0};
 	float millimeters{0};
 	uint32_t steps_event_count{0};
 	float initial_rate{0};
 	float max_entry_speed{0};
+	float max_junction_speed{0}; // max_entry_speed before it is limited to the nominal speeds either side
 	float entry_speed{0};
 	float exit_speed{0};
-	std::vector<uint32_t> steps_to_move;
-	std::vector<bool> direction;
+	uint32_t queued_ticks{0}; // how long the block is expected to take, used to measure how much time the queue holds
+#ifdef STEP_FIXED_POINT
+	// 32.32 fixed point copies of initial_rate, maximum_rate (in steps/tick) and acceleration/deceleration_per_tick
+	int64_t initial_rate_fp{0};
+	int64_t maximum_rate_fp{0};
+	int64_t acceleration_per_tick_fp{0};
+	int64_t deceleration_per_tick_fp{0};
+#endif
+	// how much u goes up by each tick of the S curve ramps
+	scurve_t accelerate_step{};
+	scurve_t decelerate_step{};
+	uint32_t steps_to_move[MAX_AXES]{};
+	uint32_t direction{0}; // bit n set if actuator n moves in the positive direction
 	struct {
 		bool nominal_length_flag:1;
-		bool recalculate_flag:1;
+		bool s_curve:1; // use the jerk limited S curve for the acceleration and deceleration ramps
 	};
+
+	bool getDirection(uint8_t i) const { return (direction & (1 << i)) != 0; }
+	void setDirection(uint8_t i, bool dir) { if(dir) direction |= (1 << i); else direction &= ~(1 << i); }
 };
 
+// libstdc++ only has is_trivially_copyable from GCC 5, the toolchains before that have the builtin
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 5
+static_assert(__has_trivial_copy(Block), "Block must be trivially copyable");
+#else
+static_assert(std::is_trivially_copyable<Block>::value, "Block must be trivially copyable");
+#endif
+
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "Block.h"
+
+#include <stddef.h>
+#include <atomic>
+
+/**
+	Fixed size ring of Blocks shared by the Planner and the step generator.
+	Thread safe for a single Producer (the planner) and a single Consumer (the block executer).
+
+	         tail              ready               head
+	  free    |  ready blocks    |  lookahead blocks |   free
+
+	The planner owns head and ready, it writes new blocks at the head and plans the blocks between
+	ready and head, when a block can no longer change it is made ready by moving the ready index past it.
+	The consumer owns tail, it executes the block at the tail in place and only releases it when it has
+	finished with it, so no locks, copies or memory allocation are needed to hand a block over.
+*/
+template <size_t RingSize>
+class BlockQueue
+{
+public:
+	static_assert((RingSize & (RingSize - 1)) == 0, "BlockQueue size must be a power of 2");
+
+	BlockQueue() : tail(0), ready(0), head(0), pushed_ticks(0), released_ticks(0) {}
+
+	size_t next(size_t n) const { return (n + 1) & (RingSize - 1); }
+	size_t prev(size_t n) const { return (n - 1) & (RingSize - 1); }
+	size_t capacity() const { return RingSize - 1; }
+
+	Block& operator[](size_t i) { return ring[i]; }
+	const Block& operator[](size_t i) const { return ring[i]; }
+
+	// Producer side, only called from the planner thread
+
+	// true if there is no space for another block
+	bool full() const { return next(head.load(std::memory_order_relaxed)) == tail.load(std::memory_order_acquire); }
+
+	// index of the next free slot, the newest block is at prev(getHeadIndex())
+	size_t getHeadIndex() const { return head.load(std::memory_order_relaxed); }
+
+	// index of the oldest block still in lookahead
+	size_t getReadyIndex() const { return ready.load(std::memory_order_relaxed); }
+
+	// the slot the next block will be written to, only valid if not full()
+	Block& getHead() { return ring[head.load(std::memory_order_relaxed)]; }
+
+	// adds the block written to getHead() to the lookahead part of the queue
+	void pushHead()
+	{
+		size_t h= head.load(std::memory_order_relaxed);
+		pushed_ticks.store(pushed_ticks.load(std::memory_order_relaxed) + ring[h].queued_ticks, std::memory_order_release);
+		head.store(next(h), std::memory_order_release);
+	}
+
+	// changes the queued_ticks of a block that is still in the lookahead
+	void setQueuedTicks(Block& b, uint32_t ticks)
+	{
+		pushed_ticks.store(pushed_ticks.load(std::memory_order_relaxed) - b.queued_ticks + ticks, std::memory_order_release);
+		b.queued_ticks= ticks;
+	}
+
+	// makes all blocks upto but not including index i available to the consumer
+	void setReadyIndex(size_t i) { ready.store(i, std::memory_order_release); }
+
+	// makes all blocks available to the consumer
+	void readyAll() { setReadyIndex(head.load(std::memory_order_relaxed)); }
+
+	// moves the ready index back so only the first keep blocks from the tail are ready, the rest are back in the lookahead
+	// and can be replanned, returns the new ready index. The consumer may release blocks meanwhile so if the tail moves
+	// the ready index is put back in case the consumer has already taken a block after the new ready index, and it tries again.
+	size_t reclaim(size_t keep)
+	{
+		size_t r= ready.load(std::memory_order_relaxed);
+		for(;;) {
+			size_t t= tail.load();
+			if(((r - t) & (RingSize - 1)) <= keep) return r;
+			size_t nr= (t + keep) & (RingSize - 1);
+			ready.store(nr);
+			if(tail.load() == t) return nr;
+			ready.store(r);
+		}
+	}
+
+	size_t lookaheadSize() const { return (head.load(std::memory_order_relaxed) - ready.load(std::memory_order_relaxed)) & (RingSize - 1); }
+
+	// Consumer side, the block executer
+
+	// returns the oldest ready block or nullptr if there are none, the block stays in the queue until releaseTail()
+	Block *getTail()
+	{
+		size_t t= tail.load(std::memory_order_relaxed);
+		if(t == ready.load(std::memory_order_acquire)) return nullptr;
+		return &ring[t];
+	}
+
+	// releases the block returned by getTail() so its slot can be reused
+	void releaseTail()
+	{
+		size_t t= tail.load(std::memory_order_relaxed);
+		released_ticks.store(released_ticks.load(std::memory_order_relaxed) + ring[t].queued_ticks, std::memory_order_release);
+		tail.store(next(t)); // sequentially consistent with reclaim()
+	}
+
+	size_t getTailIndex() const { return tail.load(std::memory_order_acquire); }
+
+	// number of blocks ready to execute, including the one currently executing
+	size_t readySize() const { return (ready.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire)) & (RingSize - 1); }
+
+	// total number of blocks in the queue
+	size_t size() const { return (head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire)) & (RingSize - 1); }
+
+	// true when all blocks have been executed and released
+	bool empty() const { return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire); }
+
+	// total queued_ticks of all the blocks in the queue, the two counts only ever go up so wrapping does not matter
+	uint32_t queuedTicks() const { return pushed_ticks.load(std::memory_order_acquire) - released_ticks.load(std::memory_order_acquire); }
+
+	// NOTE only safe to call when the consumer is not running
+	void clear() { tail.store(0); ready.store(0); head.store(0); pushed_ticks.store(0); released_ticks.store(0); }
+
+private:
+	Block ring[RingSize];
+
+	std::atomic<size_t> tail;
+	std::atomic<size_t> ready;
+	std::atomic<size_t> head;
+	// written by the producer and consumer respectively
+	std::atomic<uint32_t> pushed_ticks;
+	std::atomic<uint32_t> released_ticks;
+};
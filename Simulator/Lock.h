@@ -1,7 +1,6 @@
 #pragma once
 
 typedef void * SemaphoreHandle_t;
-void *READY_Q_MUTEX;
 
 // locks a global mutex and releases when out of scope
 class Lock
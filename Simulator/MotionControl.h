@@ -6,8 +6,26 @@
 #include <stdint.h>
 #include <stack>
 
+#include "Kinematics.h"
+#include "Actuator.h"
+
+// define STEP_BRESENHAM to build the Bresenham step engine, the axis with the most steps runs the ramp and the others
+// follow it by integer Bresenham so they always do exactly their steps, and follow it more finely at low rates (grbl's AMASS)
+#ifndef MAX_AMASS_LEVEL
+#define MAX_AMASS_LEVEL 3
+#endif
+
+// the most ticks the event scheduled step timer skips at once, it has to fit in the 16 bit timer at 1us a count
+#ifndef MAX_IDLE_TICKS
+#define MAX_IDLE_TICKS 1000
+#endif
+
+// most lines G64 Q will join into one
+#ifndef MAX_JOINED_LINES
+#define MAX_JOINED_LINES 32
+#endif
+
 class GCode;
-class Actuator;
 class Planner;
 class Block;
 
@@ -25,18 +43,52 @@ public:
 	bool isPrimaryAxis(uint8_t i) const { return primary_axis[i]; }
 	bool issueMove(const Block& block);
 	bool issueTicks(uint32_t current_tick);
+	bool issueShaperTicks();
+	uint32_t getIdleTicks(uint32_t current_tick) const;
+	void skipTicks(uint32_t n);
+	bool isShaping() const;
 	void issueUnsteps();
 	void waitForMoves();
+	void flushMoves();
+	void feedHold() { hold_requested= true; }
+	// drops a hold that has not been started yet, one sent while idle would otherwise hold the next move
+	void cancelHold() { hold_requested= false; hold_speed= 0; }
+	// the speed override changed, the executing block is re-ramped to it
+	void changeSpeed() { speed_changed= true; }
+	bool isHolding() const { return holding; }
+	bool resume();
 	bool isStepped() const { return stepped; }
+	// the block being executed and how many ticks of it have been issued
+	const Block *getExecutingBlock() const { return executing_block; }
+	uint32_t getElapsedTicks() const { return elapsed_ticks; }
 
 	// bool isAnythingMoving() const { return moving_mask != 0; }
 	// void setNothingMoving() { moving_mask= 0; }
 
 	Actuator& getActuator(char axis);
 	std::vector<Actuator>& getActuators() { return actuators; }
+	const Kinematics& getKinematics() const { return *kinematics; }
 
 private:
 	bool handleG0G1(GCode&);
+	bool handleG2G3(GCode&);
+	void getTarget(GCode& gc, float *target);
+	bool appendArc(const float *target, const float *offset, bool clockwise, float rate_mms);
+	void appendLine(const float *target, float rate_mms);
+	void blendCorner(const float *target, float rate_mms);
+	void planLine(const float *start, const float *end, float rate_mms);
+	void flushLine();
+	bool joinLine(const float *end);
+	void segmentLine(const float *start, const float *end, float rate_mms);
+	void toActuators(const float *cartesian, float *actuator);
+	bool isReachable(const float *cartesian) const;
+	void updateActuatorPositions();
+#ifdef STEP_BRESENHAM
+	bool issueFollowerSteps(uint32_t to);
+#endif
+	void startReramp();
+	void rerampTick();
+	void holdPastBlock();
 	bool handleSettings(GCode&);
 	bool handleSetAxisPosition(GCode& gc);
 	bool handleSetSpeedOverride(GCode& gc);
@@ -51,7 +103,8 @@ private:
 	float fromMillimeters(float value){ return this->inch_mode ? value / 25.4F : value; }
 
 	float seek_rate, feed_rate;
-	float seconds_per_minute{60.0F};
+	float arc_tolerance{0.01F}; // maximum distance in mm an arc segment chord is allowed to be from the arc
+	char plane_axis[3]{'X', 'Y', 'Z'}; // the two axis the arc is in and the linear axis for helical arcs, set by G17, G18, G19
 	//uint32_t moving_mask{0};
 
 	std::vector<Actuator> actuators;
@@ -60,6 +113,55 @@ private:
 	std::vector<bool> primary_axis;
 
 	std::vector<float> last_milestone;
+
+	// feed hold, requested from the command thread and started by issueTicks(), not in the bitfield as that is written by the ISR
+	volatile bool hold_requested{false};
+	volatile bool holding{false};
+	// the speed the hold had got down to when the last block ran out, it carries on slowing down from it in the next block
+	float hold_speed{0};
+
+	// M220 re-ramps the executing block, requested from the command thread and started by issueTicks()
+	volatile bool speed_changed{false};
+	bool reramping{false};
+	bool reramp_exiting{false}; // slowing down (or speeding up) to the exit speed of the block
+	uint8_t reramp_axis{0}; // the actuator with the most steps, which decides when to go to the exit speed
+
+	// written by issueMove() and the step ticker, read by the planner to work out how long the queue will take
+	const Block * volatile executing_block{nullptr};
+	volatile uint32_t elapsed_ticks{0};
+
+#ifdef STEP_BRESENHAM
+	// the followers step when their counter passes the sub steps in the block, which is its steps << amass_level,
+	// so the slower the block the more places in between the steps of the dominant axis they can step at
+	uint32_t follower_counter[MAX_AXES];
+	uint32_t follower_steps[MAX_AXES];
+	uint8_t followers[MAX_AXES];
+	uint8_t n_followers{0};
+	uint8_t dominant{0};
+	uint8_t amass_level{0};
+	uint32_t sub_steps_total{0};
+	uint32_t sub_steps_done{0};
+#endif
+
+	// G64 blending holds back the end of the last line until the next move is known, the planner has
+	// been given the moves up to planned_position and the rest of the line up to last_milestone is pending
+	std::vector<float> planned_position;
+	float pending_rate;
+	float blend_tolerance{0.02F}; // maximum distance in mm the blend is allowed to cut the corner by, set by G64 P
+
+	// G64 Q joins lines that are in line, the line from line_start to line_end has not been given to the planner yet
+	std::vector<float> line_start;
+	std::vector<float> line_end;
+	std::vector<float> joints; // the line_joints positions where the joined lines meet
+	float line_rate;
+	uint8_t line_joints;
+	float join_tolerance{0}; // maximum distance in mm a joined point can be off the line, set by G64 Q
+
+	// M669 selects the kinematics, lines are split into segments_per_second segments when they are not linear (M665 S)
+	CartesianKinematics cartesian_kinematics;
+	DeltaKinematics delta_kinematics;
+	Kinematics *kinematics{&cartesian_kinematics};
+	float segments_per_second{100};
 	using saved_state_t = std::tuple<float, float, bool> ; // save current feedrate and absolute mode
 	std::stack<saved_state_t> state_stack;                 // saves state from M120
 
@@ -67,5 +169,8 @@ private:
 		bool absolute_mode:1;
 		bool inch_mode:1;
 		bool stepped:1;
+		bool blend_mode:1; // G64 continuous path blending, G61 turns it off
+		bool move_pending:1;
+		bool line_pending:1;
 	};
 };
@@ -0,0 +1,43 @@
+#include "StepRenderer.h"
+
+#include <string.h>
+
+StepRenderer::StepRenderer(StepProducer& producer) : producer(producer)
+{
+	memset(buffers, 0, sizeof(buffers));
+}
+
+void StepRenderer::assign(size_t actuator, uint8_t step_port, uint16_t step_pin, bool step_inverted, uint8_t dir_port, uint16_t dir_pin, bool dir_inverted)
+{
+	steps[actuator].assign(step_port, step_pin, step_inverted);
+	dirs[actuator].assign(dir_port, dir_pin, dir_inverted);
+}
+
+void StepRenderer::clear(int half)
+{
+	for (size_t p = 0; p < STEP_RENDER_PORTS; ++p) {
+		memset(&buffers[p][half * BUFFER_SIZE / 2], 0, BUFFER_SIZE / 2 * sizeof(uint32_t));
+	}
+}
+
+// renders the next STEP_RENDER_TICKS ticks into half of the buffers, which the DMA has just finished writing
+void StepRenderer::render(int half)
+{
+	clear(half);
+	size_t w= half * BUFFER_SIZE / 2;
+	for (size_t t = 0; t < STEP_RENDER_TICKS; ++t, w += STEP_RENDER_SLOTS) {
+		uint32_t changed;
+		uint32_t stepped= producer.play(changed);
+		for (size_t i = 0; (stepped | changed) >> i != 0; ++i) {
+			if(changed & (1 << i)) {
+				const Pin& d= dirs[i];
+				buffers[d.port][w] |= producer.getDir(i) ? d.on_word : d.off_word;
+			}
+			if(stepped & (1 << i)) {
+				const Pin& s= steps[i];
+				buffers[s.port][w] |= s.on_word;
+				buffers[s.port][w + 1] |= s.off_word;
+			}
+		}
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "StepProducer.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+// ticks rendered each time half the buffers have been written, 0.5ms
+#ifndef STEP_RENDER_TICKS
+#define STEP_RENDER_TICKS 50
+#endif
+// most GPIO ports the step and direction pins can be on, one DMA stream each
+#ifndef STEP_RENDER_PORTS
+#define STEP_RENDER_PORTS 4
+#endif
+// words each tick takes in a buffer, the step and direction edges then the unstep half a tick later
+#define STEP_RENDER_SLOTS 2
+
+/**
+	Renders the steps played from a StepProducer into a buffer of GPIO BSRR words for each port, so the pins can be written
+	by DMA rather than by the CPU in the step ticker ISR.
+
+	Each tick is STEP_RENDER_SLOTS words in each buffer, the first sets the step pins that step on that tick and any
+	direction pins that change, the second resets the step pins again. One DMA stream for each port writes its buffer to
+	the port BSRR, they are all triggered by the same timer at STEP_RENDER_SLOTS times the step ticker rate and run in
+	circular mode, when each half of the buffers has been written render() fills it with the next STEP_RENDER_TICKS ticks.
+	A word of 0 changes nothing.
+*/
+class StepRenderer
+{
+public:
+	static const size_t BUFFER_SIZE= 2 * STEP_RENDER_TICKS * STEP_RENDER_SLOTS;
+
+	StepRenderer(StepProducer& producer);
+	// the ports are indexes into the buffers, the pins are the bit masks as GPIOPin has them
+	void assign(size_t actuator, uint8_t step_port, uint16_t step_pin, bool step_inverted, uint8_t dir_port, uint16_t dir_pin, bool dir_inverted);
+	// Runs in the DMA interrupt
+	void render(int half);
+	void clear(int half);
+
+	uint32_t *getBuffer(uint8_t port) { return buffers[port]; }
+
+private:
+	// the BSRR words that set and reset a pin
+	struct Pin
+	{
+		void assign(uint8_t p, uint16_t pin, bool inverted)
+		{
+			port= p;
+			on_word= inverted ? (uint32_t)pin << 16 : pin;
+			off_word= inverted ? pin : (uint32_t)pin << 16;
+		}
+
+		uint8_t port{0};
+		uint32_t on_word{0};
+		uint32_t off_word{0};
+	};
+
+	StepProducer& producer;
+	Pin steps[MAX_AXES];
+	Pin dirs[MAX_AXES];
+	uint32_t buffers[STEP_RENDER_PORTS][BUFFER_SIZE];
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include "StepLog.h"
+
+/**
+	Pin policy for the Actuator in the Simulator, there are no pins so it just counts what would have been written
+	so the tests can check the step stream. The firmware has its own StepperPins that writes the GPIO ports.
+*/
+class StepperPins
+{
+public:
+	void setStep(bool on) { if(on) { ++steps; log.add(dir); } step= on; }
+	void setDir(bool on) { dir= on; ++dir_sets; }
+	void setEnable(bool on) { enabled= on; }
+	// the firmware writes the steps of all the pins on a port together here
+	static void flushSteps() {}
+	static void flushUnsteps() {}
+	// the steps since they were last taken for the StepProducer, which way each went is put in dirs
+	uint8_t takeSteps(bool *dirs) { return log.take(dirs); }
+
+	uint32_t steps{0};    // step pulses issued
+	uint32_t dir_sets{0}; // times the direction pin was written
+	bool step{false};
+	bool dir{false};
+	bool enabled{false};
+	StepLog log;
+};
@@ -0,0 +1,409 @@
+/*
+	Microbenchmarks for the planner, the step generator and the gcode front end.
+
+	make bench && ./bench [file.g ...]
+
+	Runs each benchmark over some generated gcode corpora, and over any gcode files given on the command line,
+	and prints one CSV line per benchmark and corpus to stdout...
+
+	  engine,benchmark,corpus,calls,ns_per_call,allocs_per_call,bytes_per_call
+
+	Build with make bench FIXED_POINT=1 to compare the fixed point step generator, and BRESENHAM=1 for the Bresenham engine.
+*/
+
+#include "Kernel.h"
+#include "GCodeProcessor.h"
+#include "Dispatcher.h"
+#include "GCode.h"
+#include "MotionControl.h"
+#include "Block.h"
+#include "Planner.h"
+#include "Actuator.h"
+#include "StepProducer.h"
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <fstream>
+#include <chrono>
+#include <new>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// count every heap allocation so we can see which calls allocate, nothing on the step path is allowed to
+static size_t alloc_count= 0;
+static size_t alloc_bytes= 0;
+
+__attribute__((noinline)) void *operator new(size_t n)
+{
+	++alloc_count;
+	alloc_bytes += n;
+	void *p= malloc(n == 0 ? 1 : n);
+	if(p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+using Clock = std::chrono::steady_clock;
+
+// accumulates the time and allocations of the calls made between start() and stop()
+class Meter
+{
+public:
+	void start() { a= alloc_count; b= alloc_bytes; t= Clock::now(); }
+	// calls is how many calls were made since start(), so tight loops can be timed as a batch
+	void stop(uint64_t calls= 1)
+	{
+		auto e= Clock::now();
+		ns += std::chrono::duration_cast<std::chrono::nanoseconds>(e - t).count();
+		allocs += alloc_count - a;
+		bytes += alloc_bytes - b;
+		n += calls;
+		++samples;
+	}
+
+	uint64_t n{0}, samples{0}, ns{0}, allocs{0}, bytes{0};
+
+private:
+	Clock::time_point t;
+	size_t a, b;
+};
+
+// the cost of an empty start()/stop(), taken off each sample
+static double clock_overhead= 0;
+
+static void calibrate()
+{
+	Meter m;
+	for (int i = 0; i < 100000; ++i) {
+		m.start();
+		m.stop();
+	}
+	clock_overhead= (double)m.ns / m.samples;
+}
+
+#if defined(STEP_FIXED_POINT) && defined(STEP_BRESENHAM)
+static const char *engine= "fixed-bresenham";
+#elif defined(STEP_BRESENHAM)
+static const char *engine= "float-bresenham";
+#elif defined(STEP_FIXED_POINT)
+static const char *engine= "fixed";
+#else
+static const char *engine= "float";
+#endif
+
+static void report(const char *benchmark, const std::string& corpus, const Meter& m)
+{
+	if(m.n == 0) return;
+	double ns= std::max(0.0, m.ns - clock_overhead * m.samples);
+	printf("%s,%s,%s,%llu,%1.1f,%1.3f,%1.1f\n", engine, benchmark, corpus.c_str(), (unsigned long long)m.n,
+		ns / m.n, (double)m.allocs / m.n, (double)m.bytes / m.n);
+}
+
+using Corpus_t = std::vector<std::string>;
+
+static const char *prologue[]= { "G21", "G90", "G92 X0 Y0 Z0 E0" };
+
+// 10 circles of 360 segments with a rapid jog between each, like an arc exported as lines
+static Corpus_t circleJog()
+{
+	Corpus_t c(std::begin(prologue), std::end(prologue));
+	char buf[64];
+	for (int k = 0; k < 10; ++k) {
+		float cx= 50 + (k % 5) * 30, cy= 50 + (k / 5) * 30, r= 10;
+		snprintf(buf, sizeof(buf), "G0 X%1.4f Y%1.4f F12000", cx + r, cy);
+		c.push_back(buf);
+		for (int i = 1; i <= 360; ++i) {
+			float a= i * (float)M_PI / 180;
+			snprintf(buf, sizeof(buf), "G1 X%1.4f Y%1.4f F3000", cx + r * cosf(a), cy + r * sinf(a));
+			c.push_back(buf);
+		}
+	}
+	return c;
+}
+
+// 5000 segments of 0.05mm following a gentle curve, the worst case for the lookahead
+static Corpus_t tinySegments()
+{
+	Corpus_t c(std::begin(prologue), std::end(prologue));
+	char buf[64];
+	float e= 0;
+	for (int i = 1; i <= 5000; ++i) {
+		float x= i * 0.05F;
+		e += 0.002F;
+		snprintf(buf, sizeof(buf), "G1 X%1.4f Y%1.4f E%1.4f F6000", x, 2 * sinf(x / 4), e);
+		c.push_back(buf);
+	}
+	return c;
+}
+
+// an infill raster of 20mm lines 0.4mm apart, square corners every other line
+static Corpus_t zigzag()
+{
+	Corpus_t c(std::begin(prologue), std::end(prologue));
+	char buf[64];
+	float e= 0;
+	for (int i = 1; i <= 500; ++i) {
+		e += 1.0F;
+		snprintf(buf, sizeof(buf), "G1 X%d Y%1.2f E%1.4f F9000", (i & 1) ? 20 : 0, (i - 1) * 0.4F, e);
+		c.push_back(buf);
+		e += 0.02F;
+		snprintf(buf, sizeof(buf), "G1 Y%1.2f E%1.4f", i * 0.4F, e);
+		c.push_back(buf);
+	}
+	return c;
+}
+
+static bool loadFile(const char *fn, Corpus_t& c)
+{
+	std::ifstream f(fn);
+	if(!f) return false;
+	std::string line;
+	while(std::getline(f, line)) {
+		if(!line.empty() && line.back() == '\r') line.pop_back();
+		c.push_back(line);
+	}
+	return true;
+}
+
+// gets at the private parts of the planner
+struct PlannerBench
+{
+	static void recalculate(Planner& p) { p.recalculate(); }
+	static void calculateTrapezoid(Planner& p, Block& b, float entry, float exit) { p.calculateTrapezoid(b, entry, exit); }
+	static float minimumSpeed(const Planner& p) { return p.minimum_planner_speed; }
+};
+
+// what the block executer does with each ready block, called when the planner waits for a free slot and when draining
+static std::function<void(Block&)> execute_block;
+
+static void executeReady()
+{
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+	Block *b;
+	while((b= q.getTail()) != nullptr) {
+		execute_block(*b);
+		q.releaseTail();
+	}
+}
+
+static void drain()
+{
+	THEKERNEL.getMotionControl().flushMoves();
+	THEKERNEL.getPlanner().moveAllToReady();
+	executeReady();
+}
+
+static void restart()
+{
+	THEKERNEL.getPlanner().purge();
+	THEKERNEL.getMotionControl().resetAxisPositions();
+}
+
+static void benchParse(const std::string& name, const Corpus_t& corpus)
+{
+	GCodeProcessor gp;
+	Meter m;
+	for (auto& l : corpus) {
+		m.start();
+		GCodeProcessor::GCodes_t gcodes;
+		gp.parse(l.c_str(), gcodes);
+		m.stop();
+	}
+	report("GCodeProcessor::parse", name, m);
+}
+
+static void benchDispatch(const std::string& name, const std::vector<GCodeProcessor::GCodes_t>& parsed)
+{
+	restart();
+	execute_block= [](Block&) {};
+	Meter m;
+	for (auto& gcodes : parsed) {
+		for (auto gc : gcodes) {
+			m.start();
+			THEDISPATCHER.dispatch(gc);
+			m.stop();
+		}
+	}
+	drain();
+	report("Dispatcher::dispatch", name, m);
+}
+
+// calls the planner directly with the targets from the corpus, so none of the gcode handling is included
+static void benchPlanner(const std::string& name, const std::vector<GCodeProcessor::GCodes_t>& parsed)
+{
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	Planner& planner= THEKERNEL.getPlanner();
+	Planner::Queue_t& q= planner.getQueue();
+	size_t n_axis= mc.getActuators().size();
+	std::vector<float> last(n_axis, 0), target(n_axis, 0);
+	float rate_mms= 50;
+
+	restart();
+	Meter plan, recalc, trapezoid;
+	execute_block= [&](Block& b) {
+		size_t n= q.next(q.getTailIndex());
+		float exit= n == q.getHeadIndex() ? PlannerBench::minimumSpeed(planner) : q[n].entry_speed;
+		trapezoid.start();
+		PlannerBench::calculateTrapezoid(planner, b, b.entry_speed, exit);
+		trapezoid.stop();
+	};
+
+	for (auto& gcodes : parsed) {
+		for (auto& gc : gcodes) {
+			if(!gc.hasG()) continue;
+			bool move= gc.getCode() == 0 || gc.getCode() == 1;
+			if(!move && gc.getCode() != 92) continue;
+			for (size_t i = 0; i < n_axis; ++i) {
+				char a= mc.getActuatorAxis(i);
+				if(gc.hasArg(a)) target[i]= gc.getArg(a);
+			}
+			if(gc.hasArg('F')) rate_mms= gc.getArg('F') / 60;
+			if(move) {
+				plan.start();
+				planner.plan(last.data(), target.data(), n_axis, mc.getActuators().data(), rate_mms);
+				plan.stop();
+
+				// run it again to get the cost of one pass over the lookahead on its own, this changes nothing
+				recalc.start();
+				PlannerBench::recalculate(planner);
+				recalc.stop();
+			}
+			last= target;
+		}
+	}
+	planner.moveAllToReady();
+	executeReady();
+	report("Planner::plan", name, plan);
+	report("Planner::recalculate", name, recalc);
+	report("Planner::calculateTrapezoid", name, trapezoid);
+}
+
+// steps every block, timing the loops that run in the step ticker ISR
+static void benchStepper(const std::string& name, const std::vector<GCodeProcessor::GCodes_t>& parsed)
+{
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	Actuator& xact= mc.getActuator('X');
+
+	restart();
+	Meter ticks, xticks;
+	execute_block= [&](Block& b) {
+		mc.issueMove(b);
+		uint32_t current_tick= 0;
+		ticks.start();
+		while(mc.issueTicks(++current_tick)) ;
+		ticks.stop(current_tick);
+
+		// then just the X actuator on its own
+		if(b.steps_to_move[mc.getAxisActuator('X')] == 0) return;
+		mc.issueMove(b);
+		current_tick= 0;
+		bool stepped;
+		xticks.start();
+		while(xact.tick(++current_tick, stepped)) ;
+		xticks.stop(current_tick);
+	};
+
+	for (auto& gcodes : parsed) {
+		for (auto gc : gcodes) {
+			THEDISPATCHER.dispatch(gc);
+		}
+	}
+	drain();
+	report("MotionControl::issueTicks", name, ticks);
+	report("Actuator::tick", name, xticks);
+}
+
+// records the steps the X actuator makes for the corpus, then compresses them on their own
+static void benchCompress(const std::string& name, const std::vector<GCodeProcessor::GCodes_t>& parsed)
+{
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	Actuator& xact= mc.getActuator('X');
+
+	std::vector<std::pair<uint64_t, bool>> steps;
+	uint64_t time= 0;
+	restart();
+	execute_block= [&](Block& b) {
+		mc.issueMove(b);
+		uint32_t current_tick= 0;
+		bool more;
+		do {
+			more= mc.issueTicks(++current_tick);
+			++time;
+			bool dirs[MAX_STEPS_PER_TICK];
+			uint8_t n= xact.getPins().takeSteps(dirs);
+			for (uint8_t i = 0; i < n; ++i) steps.emplace_back(time, dirs[i]);
+		} while(more);
+	};
+
+	for (auto& gcodes : parsed) {
+		for (auto gc : gcodes) {
+			THEDISPATCHER.dispatch(gc);
+		}
+	}
+	drain();
+
+	StepCompressor *compressor= new StepCompressor;
+	StepChunkQueue *queue= new StepChunkQueue;
+	Meter compress;
+	size_t chunks= 0;
+	auto one= [&]() {
+		compress.start();
+		compressor->compress(*queue);
+		compress.stop(1);
+		while(!queue->empty()) { queue->pop(); ++chunks; }
+	};
+	for (auto& s : steps) {
+		if(compressor->isFull()) one();
+		compressor->push(s.first, s.second);
+	}
+	while(!compressor->isEmpty()) one();
+	delete queue;
+	delete compressor;
+	if(chunks > 0) report("StepCompressor::compress", name, compress);
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::pair<std::string, Corpus_t>> corpora;
+	corpora.emplace_back("circle-jog", circleJog());
+	corpora.emplace_back("tiny-segments", tinySegments());
+	corpora.emplace_back("zigzag", zigzag());
+	for (int i = 1; i < argc; ++i) {
+		Corpus_t c;
+		if(!loadFile(argv[i], c)) {
+			fprintf(stderr, "could not read %s\n", argv[i]);
+			return 1;
+		}
+		corpora.emplace_back(argv[i], c);
+	}
+
+	THEKERNEL.initialize();
+	// there is no block executer thread, so when the planner waits for space it runs the ready blocks itself
+	THEKERNEL.assignHALFunction(Kernel::DELAY, [](void*, size_t, uint32_t) -> size_t { executeReady(); return 0; });
+
+	calibrate();
+	printf("engine,benchmark,corpus,calls,ns_per_call,allocs_per_call,bytes_per_call\n");
+
+	for (auto& c : corpora) {
+		std::vector<GCodeProcessor::GCodes_t> parsed;
+		GCodeProcessor gp;
+		for (auto& l : c.second) {
+			GCodeProcessor::GCodes_t gcodes;
+			if(gp.parse(l.c_str(), gcodes)) parsed.push_back(gcodes);
+		}
+
+		benchParse(c.first, c.second);
+		benchDispatch(c.first, parsed);
+		benchPlanner(c.first, parsed);
+		benchStepper(c.first, parsed);
+		benchCompress(c.first, parsed);
+	}
+
+	return 0;
+}
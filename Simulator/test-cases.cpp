@@ -6,8 +6,12 @@
 #include "Block.h"
 #include "Planner.h"
 #include "Actuator.h"
+#include "InputShaper.h"
+#include "StepProducer.h"
+#include "StepRenderer.h"
 
 #include <map>
+#include <fstream>
 #include <vector>
 #include <iostream>
 #include <stdint.h>
@@ -183,40 +187,49 @@ TEST_CASE( "Planning", "[planner]" ) {
 			THEDISPATCHER.dispatch(i);
 		}
 
-		Planner::Queue_t& lq= THEKERNEL.getPlanner().getLookAheadQueue();
-		REQUIRE(lq.size() == 1);
-		Planner::Queue_t& rq= THEKERNEL.getPlanner().getReadyQueue();
-		REQUIRE(rq.size() == 2);
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+		REQUIRE(q.lookaheadSize() == 1);
+		REQUIRE(q.readySize() == 2);
+
+		// trapezoids are only calculated when a block is made ready
+		REQUIRE(q[q.getReadyIndex()].total_move_ticks == 0);
 
 		// dump planned block queue
 		THEKERNEL.getPlanner().moveAllToReady();
 		THEKERNEL.getPlanner().dump(cout);
 
 		// iterate over block queue and check it
-		REQUIRE(rq.size() == 3);
-		Block block= rq.back();
-		REQUIRE(block.total_move_ticks == 1000);
-		REQUIRE(block.accelerate_until == 1000);
-		REQUIRE(block.decelerate_after == 1000);
-		REQUIRE(block.entry_speed == 0);
-		REQUIRE(block.exit_speed == 20);
-		rq.pop_back();
-
-		block= rq.back();
-		REQUIRE(block.total_move_ticks == 414);
-		REQUIRE(block.accelerate_until == 414);
-		REQUIRE(block.decelerate_after == 414);
-		REQUIRE(block.entry_speed == 20);
-		REQUIRE(block.exit_speed == Approx(28.2843F).epsilon(0.0001F));
-		rq.pop_back();
-
-		block= rq.back();
-		REQUIRE(block.total_move_ticks == 103585);
-		REQUIRE(block.accelerate_until == 3585);
-		REQUIRE(block.decelerate_after == 98585);
-		REQUIRE(block.entry_speed == Approx(28.2843F).epsilon(0.0001F));
-		REQUIRE(block.exit_speed == 0);
-		rq.pop_back();
+		REQUIRE(q.readySize() == 3);
+		REQUIRE(q.lookaheadSize() == 0);
+		Block *block= q.getTail();
+		REQUIRE(block != nullptr);
+		REQUIRE(block->total_move_ticks == 1000);
+		REQUIRE(block->accelerate_until == 1000);
+		REQUIRE(block->decelerate_after == 1000);
+		REQUIRE(block->entry_speed == 0);
+		REQUIRE(block->exit_speed == 20);
+		q.releaseTail();
+
+		block= q.getTail();
+		REQUIRE(block != nullptr);
+		REQUIRE(block->total_move_ticks == 414);
+		REQUIRE(block->accelerate_until == 414);
+		REQUIRE(block->decelerate_after == 414);
+		REQUIRE(block->entry_speed == 20);
+		REQUIRE(block->exit_speed == Approx(28.2843F).epsilon(0.0001F));
+		q.releaseTail();
+
+		block= q.getTail();
+		REQUIRE(block != nullptr);
+		REQUIRE(block->total_move_ticks == 103585);
+		REQUIRE(block->accelerate_until == 3585);
+		REQUIRE(block->decelerate_after == 98585);
+		REQUIRE(block->entry_speed == Approx(28.2843F).epsilon(0.0001F));
+		REQUIRE(block->exit_speed == 0);
+		q.releaseTail();
+
+		REQUIRE(q.getTail() == nullptr);
+		REQUIRE(q.empty());
 	}
 
 	SECTION("plan one axis") {
@@ -238,38 +251,35 @@ TEST_CASE( "Planning", "[planner]" ) {
 		int cnt= 0;
 
 		// iterate over block queue and check it
-		Planner::Queue_t& q= THEKERNEL.getPlanner().getLookAheadQueue();
-		Planner::Queue_t& rq= THEKERNEL.getPlanner().getReadyQueue();
-		REQUIRE(q.size() == 1);
-		REQUIRE(rq.size() == 4);
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+		REQUIRE(q.lookaheadSize() == 1);
+		REQUIRE(q.readySize() == 4);
 
-		while(!rq.empty()) {
+		while(q.readySize() > 0) {
 			INFO( "Cnt: " << cnt);
-			Block block= rq.back();
-			rq.pop_back();
-			REQUIRE(block.entry_speed == entryspeed[cnt]);
-			REQUIRE(block.exit_speed == exitspeed[cnt]);
-			REQUIRE(block.steps_to_move[0] == 10000);
+			Block *block= q.getTail();
+			REQUIRE(block->entry_speed == entryspeed[cnt]);
+			REQUIRE(block->exit_speed == exitspeed[cnt]);
+			REQUIRE(block->steps_to_move[0] == 10000);
+			q.releaseTail();
 			++cnt;
 		}
 
-		Block block= q.back();
-		q.pop_back();
-		REQUIRE(block.entry_speed == entryspeed[cnt]);
-		REQUIRE(block.exit_speed == exitspeed[cnt]);
-		REQUIRE(block.steps_to_move[0] == 10000);
+		THEKERNEL.getPlanner().moveAllToReady();
+		Block *block= q.getTail();
+		REQUIRE(block->entry_speed == entryspeed[cnt]);
+		REQUIRE(block->exit_speed == exitspeed[cnt]);
+		REQUIRE(block->steps_to_move[0] == 10000);
+		q.releaseTail();
 		++cnt;
 
 		REQUIRE(cnt == 5);
-		REQUIRE(rq.empty());
 		REQUIRE(q.empty());
 	}
 
 	SECTION("plan one axis, different speeds") {
-		Planner::Queue_t& q= THEKERNEL.getPlanner().getLookAheadQueue();
-		Planner::Queue_t& rq= THEKERNEL.getPlanner().getReadyQueue();
-		q.clear();
-		rq.clear();
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+		THEKERNEL.getPlanner().purge();
 		// Parse gcode
 		GCodeProcessor::GCodes_t gcodes;
 		bool ok= gp.parse("G92 G1 X100 F6000 G1 X200 F600 G1 X300 F6000 G1 X400 F12000 G1 X500 F12000", gcodes);
@@ -287,29 +297,29 @@ TEST_CASE( "Planning", "[planner]" ) {
 		int cnt= 0;
 
 		// iterate over block queue and check it
-		REQUIRE(q.size() == 1);
-		REQUIRE(rq.size() == 4);
+		REQUIRE(q.lookaheadSize() == 1);
+		REQUIRE(q.readySize() == 4);
 
-		while(!rq.empty()) {
+		while(q.readySize() > 0) {
 			INFO( "Block is " << cnt);
-			Block block= rq.back();
-			rq.pop_back();
-			REQUIRE(block.entry_speed == entryspeed[cnt]);
-			REQUIRE(block.exit_speed == exitspeed[cnt]);
-			REQUIRE(block.steps_to_move[0] == 10000);
+			Block *block= q.getTail();
+			REQUIRE(block->entry_speed == entryspeed[cnt]);
+			REQUIRE(block->exit_speed == exitspeed[cnt]);
+			REQUIRE(block->steps_to_move[0] == 10000);
+			q.releaseTail();
 			++cnt;
 		}
 
-		Block block= q.back();
-		q.pop_back();
-		REQUIRE(block.entry_speed == entryspeed[cnt]);
-		REQUIRE(block.exit_speed == exitspeed[cnt]);
-		REQUIRE(block.steps_to_move[0] == 10000);
+		THEKERNEL.getPlanner().moveAllToReady();
+		Block *block= q.getTail();
+		REQUIRE(block->entry_speed == entryspeed[cnt]);
+		REQUIRE(block->exit_speed == exitspeed[cnt]);
+		REQUIRE(block->steps_to_move[0] == 10000);
+		q.releaseTail();
 		++cnt;
 
 		REQUIRE(cnt == 5);
 		REQUIRE(q.empty());
-		REQUIRE(rq.empty());
 	}
 
 	SECTION("plan one axis, very short segments") {
@@ -338,12 +348,244 @@ TEST_CASE( "Planning", "[planner]" ) {
 		THEKERNEL.getPlanner().dump(cout);
 
 		// iterate over block queue and check it
-		Planner::Queue_t& q= THEKERNEL.getPlanner().getLookAheadQueue();
-		Planner::Queue_t& rq= THEKERNEL.getPlanner().getReadyQueue();
-		REQUIRE(q.size() == 1);
-		REQUIRE(rq.size() == 102);
-		rq.clear();
-		q.clear();
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+		REQUIRE(q.lookaheadSize() == 1);
+		REQUIRE(q.readySize() == 102);
+
+		// blocks handed to the executer must join up with the next block
+		THEKERNEL.getPlanner().moveAllToReady();
+		Block *prev= q.getTail();
+		q.releaseTail();
+		REQUIRE(prev->entry_speed == 0);
+		while(!q.empty()) {
+			Block *block= q.getTail();
+			INFO("Block: " << block->id);
+			REQUIRE(block->entry_speed == prev->exit_speed);
+			REQUIRE(block->entry_speed <= block->max_entry_speed);
+			prev= block;
+			q.releaseTail();
+		}
+		REQUIRE(prev->exit_speed == 0);
+		THEKERNEL.getPlanner().purge();
+		REQUIRE(q.empty());
+	}
+
+	SECTION("joining segments that are in line") {
+		Planner& planner= THEKERNEL.getPlanner();
+		Planner::Queue_t& q= planner.getQueue();
+
+		// 30 tiny segments along X wobbling by a micron in Y, then a corner, then 10 segments that extrude at a different rate
+		GCodeProcessor::GCodes_t gcodes;
+		bool ok= gp.parse("G92 X0 Y0 E0 G64 P0 Q0.01 G91 G1 X0.1 F6000", gcodes);
+		REQUIRE(ok);
+		for(auto i : gcodes) {
+			THEDISPATCHER.dispatch(i);
+		}
+		for (int i = 1; i < 30; ++i) {
+			gcodes.clear();
+			gp.parse((i & 1) ? "G1 X0.1 Y0.001" : "G1 X0.1 Y-0.001", gcodes);
+			THEDISPATCHER.dispatch(gcodes[0]);
+		}
+		for (int i = 0; i < 20; ++i) {
+			gcodes.clear();
+			gp.parse((i < 10) ? "G1 Y0.1 E0.01" : "G1 Y0.1 E0.02", gcodes);
+			THEDISPATCHER.dispatch(gcodes[0]);
+		}
+		// the last line is held back until something that is not a line comes along
+		REQUIRE(q.size() == 2);
+		THEDISPATCHER.dispatch('G', 90, 0);
+
+		REQUIRE(q.size() == 3);
+		planner.moveAllToReady();
+		REQUIRE(q.getTail()->millimeters == Approx(3));
+		size_t n= q.next(q.getTailIndex());
+		REQUIRE(q[n].millimeters == Approx(1));
+		n= q.next(n);
+		REQUIRE(q[n].millimeters == Approx(1));
+		planner.purge();
+
+		gcodes.clear();
+		ok= gp.parse("G64 P0.02 Q0 G61", gcodes);
+		for(auto i : gcodes) {
+			THEDISPATCHER.dispatch(i);
+		}
+		REQUIRE(q.empty());
+	}
+
+	SECTION("speed override changes the queued blocks") {
+		Planner& planner= THEKERNEL.getPlanner();
+		Planner::Queue_t& q= planner.getQueue();
+
+		GCodeProcessor::GCodes_t gcodes;
+		bool ok= gp.parse("G92 X0 G91 G1 X10 F6000", gcodes);
+		REQUIRE(ok);
+		for(auto i : gcodes) {
+			THEDISPATCHER.dispatch(i);
+		}
+		gcodes.clear();
+		gp.parse("G1 X10", gcodes);
+		for (int i = 0; i < 19; ++i) {
+			THEDISPATCHER.dispatch(gcodes[0]);
+		}
+		REQUIRE(q.readySize() > 2);
+
+		// checks the plan joins up and returns the nominal speeds
+		auto speeds= [&]() {
+			std::vector<float> s;
+			planner.moveAllToReady();
+			for (size_t i = q.getTailIndex(); i != q.getHeadIndex(); i= q.next(i)) {
+				INFO("Block: " << q[i].id);
+				if(i != q.getTailIndex()) REQUIRE(q[i].entry_speed == q[q.prev(i)].exit_speed);
+				REQUIRE(q[i].entry_speed <= q[i].nominal_speed);
+				s.push_back(q[i].nominal_speed);
+			}
+			return s;
+		};
+
+		// the plans of the executing block and the next one are left alone (they are re-ramped as they run), the one after
+		// that is entered at full speed so it slows
+		// down to the new speed, and the rest are at the new speed
+		THEDISPATCHER.dispatch('M', 220, 'S', 50.0F, 0);
+		std::vector<float> s= speeds();
+		REQUIRE(s.size() == 20);
+		REQUIRE(s[0] == 100);
+		REQUIRE(s[1] == 100);
+		REQUIRE(s[2] == 100);
+		REQUIRE(q[q.next(q.next(q.getTailIndex()))].exit_speed == 50);
+		for (size_t i = 3; i < s.size(); ++i) REQUIRE(s[i] == 50);
+		REQUIRE(planner.getQueuedTime() > 3.6F);
+
+		// the executing block moves on and the rest speed up again, the new blocks get the override too
+		q.releaseTail();
+		THEDISPATCHER.dispatch('M', 220, 'S', 150.0F, 0);
+		THEDISPATCHER.dispatch(gcodes[0]);
+		s= speeds();
+		REQUIRE(s.size() == 20);
+		REQUIRE(s[0] == 100);
+		REQUIRE(s[1] == 100);
+		for (size_t i = 2; i < s.size(); ++i) REQUIRE(s[i] == 150);
+
+		THEDISPATCHER.dispatch('M', 220, 'S', 100.0F, 0);
+		THEDISPATCHER.dispatch('G', 90, 0);
+		planner.purge();
+	}
+
+	SECTION("queue depth in time") {
+		Planner& planner= THEKERNEL.getPlanner();
+		Planner::Queue_t& q= planner.getQueue();
+		REQUIRE(planner.getQueuedTime() == 0);
+
+		// 0.1 seconds at nominal speed each
+		GCodeProcessor::GCodes_t gcodes;
+		bool ok= gp.parse("M205 T1.0 B100 G92 X0 G91 G1 X10 F6000", gcodes);
+		REQUIRE(ok);
+		for(auto i : gcodes) {
+			THEDISPATCHER.dispatch(i);
+		}
+		gcodes.clear();
+		gp.parse("G1 X10", gcodes);
+		int n= 1;
+		while(!planner.isQueueFull()) {
+			THEDISPATCHER.dispatch(gcodes[0]);
+			++n;
+		}
+		THEDISPATCHER.dispatch('G', 90, 0);
+		INFO("blocks: " << n << " time: " << planner.getQueuedTime());
+		// ten blocks, a little over a second as the ones made ready include the time to accelerate
+		REQUIRE(n == 10);
+		REQUIRE(planner.getQueuedTime() >= 1.0F);
+		REQUIRE(planner.getQueuedTime() < 1.1F);
+
+		// once the trapezoids are calculated the time includes the acceleration
+		planner.moveAllToReady();
+		uint32_t ticks= 0;
+		for (size_t i = q.getTailIndex(); i != q.getHeadIndex(); i= q.next(i)) {
+			ticks += q[i].total_move_ticks;
+		}
+		REQUIRE(planner.getQueuedTime() == Approx(ticks / STEP_TICKER_FREQUENCY));
+		REQUIRE(planner.getQueuedTime() > 1.0F);
+
+		// the time left counts down as the executing block is stepped
+		REQUIRE(planner.getRemainingTime() == planner.getQueuedTime());
+		MotionControl& mc= THEKERNEL.getMotionControl();
+		mc.issueMove(*q.getTail());
+		for (uint32_t t = 1; t <= 5000; ++t) mc.issueTicks(t);
+		REQUIRE(planner.getRemainingTime() == Approx((ticks - 5000) / STEP_TICKER_FREQUENCY));
+		gcodes.clear();
+		gp.parse("M400.1", gcodes);
+		char buf[32];
+		snprintf(buf, sizeof(buf), "T:%1.3f B:%d", (ticks - 5000) / STEP_TICKER_FREQUENCY, (int)q.size());
+		REQUIRE(THEDISPATCHER.dispatch(gcodes[0]).find(buf) != std::string::npos);
+
+		// and goes down as blocks are executed
+		while(!q.empty()) {
+			ticks -= q.getTail()->total_move_ticks;
+			q.releaseTail();
+			REQUIRE(planner.getQueuedTime() == Approx(ticks / STEP_TICKER_FREQUENCY));
+		}
+		REQUIRE(planner.getQueuedTime() == 0);
+		REQUIRE_FALSE(planner.isQueueFull());
+
+		// the block limit still applies to short moves
+		THEDISPATCHER.dispatch('M', 205, 'T', 10.0F, 'B', 20.0F, 0);
+		gcodes.clear();
+		gp.parse("G91 G1 X0.01", gcodes);
+		THEDISPATCHER.dispatch(gcodes[0]);
+		n= 0;
+		while(!planner.isQueueFull()) {
+			THEDISPATCHER.dispatch(gcodes[1]);
+			++n;
+		}
+		THEDISPATCHER.dispatch('G', 90, 0);
+		REQUIRE(n == 20);
+		planner.purge();
+		THEDISPATCHER.dispatch('M', 205, 'T', 2.0F, 'B', (float)(BLOCK_QUEUE_SIZE - 8), 0);
+	}
+
+	SECTION("per axis junction speed") {
+		Planner& planner= THEKERNEL.getPlanner();
+		Planner::Queue_t& q= planner.getQueue();
+
+		// returns the max entry speeds of the second and third moves
+		auto junctions= [&](const char *gcode) {
+			GCodeProcessor::GCodes_t gcodes;
+			bool ok= gp.parse(gcode, gcodes);
+			REQUIRE(ok);
+			for(auto i : gcodes) {
+				THEDISPATCHER.dispatch(i);
+			}
+			size_t first= q.getTailIndex();
+			std::pair<float, float> r(q[q.next(first)].max_entry_speed, q[q.next(q.next(first))].max_entry_speed);
+			planner.purge();
+			return r;
+		};
+
+		// an X reversal followed by a right angle turn into Y
+		const char *square= "G92 X0 Y0 Z0 G1 X10 F6000 G1 X0 G1 Y10";
+		const char *xz= "G92 X0 Y0 Z0 G1 X10 F6000 G1 X0 G1 Z1";
+		auto jd= junctions(square);
+		float xz_jd= junctions(xz).second;
+		REQUIRE(jd.first == 0);
+		REQUIRE(jd.second == Approx(15.5377F).epsilon(0.0001F));
+
+		// X reverses at half its limit, X stops and Y starts at its limit
+		THEDISPATCHER.dispatch('M', 566, 'X', 30.0F, 'Y', 30.0F, 0);
+		auto pa= junctions(square);
+		REQUIRE(pa.first == Approx(15));
+		REQUIRE(pa.second == Approx(30));
+
+		// the junction deviation is still used when it is faster, or when an axis without a limit changes
+		THEDISPATCHER.dispatch('M', 566, 'X', 5.0F, 'Y', 5.0F, 0);
+		REQUIRE(junctions(square).second == jd.second);
+		THEDISPATCHER.dispatch('M', 566, 'X', 30.0F, 'Y', 30.0F, 0);
+		REQUIRE(junctions(xz).second == xz_jd);
+
+		// only the primary axis are in the unit vector, so extruding at the same time does not change the junctions
+		auto e= junctions("G92 X0 Y0 Z0 E0 G1 X10 E1 F6000 G1 X0 E3 G1 Y10 E4");
+		REQUIRE(e.first == pa.first);
+		REQUIRE(e.second == pa.second);
+
+		THEDISPATCHER.dispatch('M', 566, 'X', 0.0F, 'Y', 0.0F, 0);
 	}
 }
 
@@ -351,20 +593,6 @@ TEST_CASE( "Planning and Stepping", "[stepper]" ) {
 	GCodeProcessor& gp= THEKERNEL.getGCodeProcessor();
     MotionControl& mc= THEKERNEL.getMotionControl();
 
-    // Setup pins for each Actuator
-    mc.getActuator('X').assignHALFunction(Actuator::SET_STEP,   [](bool ) { /*cout << "X_StepPin::set(" << on << ")\n"; */ });
-    mc.getActuator('X').assignHALFunction(Actuator::SET_DIR,    [](bool ) { /*cout << "X_DirPin::set(" << on << ")\n";  */ });
-    mc.getActuator('X').assignHALFunction(Actuator::SET_ENABLE, [](bool ) { /*cout << "X_EnbPin::set(" << on << ")\n";  */ });
-    mc.getActuator('Y').assignHALFunction(Actuator::SET_STEP,   [](bool ) { /*cout << "Y_StepPin::set(" << on << ")\n"; */ });
-    mc.getActuator('Y').assignHALFunction(Actuator::SET_DIR,    [](bool ) { /*cout << "Y_DirPin::set(" << on << ")\n";  */ });
-    mc.getActuator('Y').assignHALFunction(Actuator::SET_ENABLE, [](bool ) { /*cout << "Y_EnbPin::set(" << on << ")\n";  */ });
-    mc.getActuator('Z').assignHALFunction(Actuator::SET_STEP,   [](bool ) { /*cout << "Z_StepPin::set(" << on << ")\n"; */ });
-    mc.getActuator('Z').assignHALFunction(Actuator::SET_DIR,    [](bool ) { /*cout << "Z_DirPin::set(" << on << ")\n";  */ });
-    mc.getActuator('Z').assignHALFunction(Actuator::SET_ENABLE, [](bool ) { /*cout << "Z_EnbPin::set(" << on << ")\n";  */ });
-    mc.getActuator('E').assignHALFunction(Actuator::SET_STEP,   [](bool ) { /*cout << "E_StepPin::set(" << on << ")\n"; */ });
-    mc.getActuator('E').assignHALFunction(Actuator::SET_DIR,    [](bool ) { /*cout << "E_DirPin::set(" << on << ")\n";  */ });
-    mc.getActuator('E').assignHALFunction(Actuator::SET_ENABLE, [](bool ) { /*cout << "E_EnbPin::set(" << on << ")\n";  */ });
-
 	SECTION("Generate Steps, one axis") {
 		// Parse gcode
 		GCodeProcessor::GCodes_t gcodes;
@@ -382,15 +610,16 @@ TEST_CASE( "Planning and Stepping", "[stepper]" ) {
 		const Actuator& xact= THEKERNEL.getMotionControl().getActuator('X');
 		const float pos[]{100,200,300,400,500};
 		int cnt= 0;
+		uint32_t pulses= xact.getPins().steps;
 
 		// iterate over block queue and setup steppers
 		THEKERNEL.getPlanner().moveAllToReady();
-		Planner::Queue_t& q= THEKERNEL.getPlanner().getReadyQueue();
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
 		while(!q.empty()) {
-			Block block= q.back();
-			q.pop_back();
-			INFO("Playing Block: " << block.id);
-			THEKERNEL.getMotionControl().issueMove(block);
+			// executes the block in place
+			Block *block= q.getTail();
+			INFO("Playing Block: " << block->id);
+			THEKERNEL.getMotionControl().issueMove(*block);
 			// simulate step ticker
 			uint32_t current_tick= 0;
 			bool r= true;
@@ -398,12 +627,17 @@ TEST_CASE( "Planning and Stepping", "[stepper]" ) {
 		  		++current_tick;
 				r= THEKERNEL.getMotionControl().issueTicks(current_tick);
 			}
+			// finished with the block
+			q.releaseTail();
 			// check we got where we requested to go
 			REQUIRE(xact.getCurrentPositionInmm() == pos[cnt++]);
 			INFO("Done");
 		}
 
 		REQUIRE(xact.getCurrentPositionInmm() == 500);
+		// every step went out on the pin
+		pulses= xact.getPins().steps - pulses;
+		REQUIRE(pulses == 500 * xact.getStepsPermm());
 		REQUIRE(q.empty());
 	}
 
@@ -429,12 +663,12 @@ TEST_CASE( "Planning and Stepping", "[stepper]" ) {
 
 		// iterate over block queue and setup steppers
 		THEKERNEL.getPlanner().moveAllToReady();
-		Planner::Queue_t& q= THEKERNEL.getPlanner().getReadyQueue();
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
 		while(!q.empty()) {
-			Block block= q.back();
-			q.pop_back();
-			INFO("Playing Block: " << block.id);
-			THEKERNEL.getMotionControl().issueMove(block);
+			// executes the block in place
+			Block *block= q.getTail();
+			INFO("Playing Block: " << block->id);
+			THEKERNEL.getMotionControl().issueMove(*block);
 			// simulate step ticker
 			uint32_t current_tick= 0;
 			bool r= true;
@@ -442,6 +676,8 @@ TEST_CASE( "Planning and Stepping", "[stepper]" ) {
 		  		++current_tick;
 				r= THEKERNEL.getMotionControl().issueTicks(current_tick);
 			}
+			// finished with the block
+			q.releaseTail();
 			// check we got where we requested to go
 			REQUIRE(xact.getCurrentPositionInmm() == xpos[cnt]);
 			REQUIRE(yact.getCurrentPositionInmm() == ypos[cnt]);
@@ -482,12 +718,12 @@ TEST_CASE( "Planning and Stepping", "[stepper]" ) {
 
 		// iterate over block queue and setup steppers
 		THEKERNEL.getPlanner().moveAllToReady();
-		Planner::Queue_t& q= THEKERNEL.getPlanner().getReadyQueue();
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
 		while(!q.empty()) {
-			Block block= q.back();
-			q.pop_back();
-			INFO("Playing Block: " << block.id);
-			THEKERNEL.getMotionControl().issueMove(block);
+			// executes the block in place
+			Block *block= q.getTail();
+			INFO("Playing Block: " << block->id);
+			THEKERNEL.getMotionControl().issueMove(*block);
 			// simulate step ticker
 			uint32_t current_tick= 0;
 			bool r= true;
@@ -495,6 +731,8 @@ TEST_CASE( "Planning and Stepping", "[stepper]" ) {
 		  		++current_tick;
 				r= THEKERNEL.getMotionControl().issueTicks(current_tick);
 			}
+			// finished with the block
+			q.releaseTail();
 			// check we got where we requested to go
 			REQUIRE(xact.getCurrentPositionInmm() == xpos[cnt]);
 			REQUIRE(yact.getCurrentPositionInmm() == ypos[cnt]);
@@ -508,6 +746,1127 @@ TEST_CASE( "Planning and Stepping", "[stepper]" ) {
 		REQUIRE(eact.getCurrentPositionInmm() == Approx(4.75F).epsilon(0.001F));
 	}
 }
+
+// runs all the queued blocks through the step generator, returns the worst number of ticks a block overran its planned time by
+static int32_t stepAllBlocks()
+{
+	int32_t overrun= 0;
+	THEKERNEL.getPlanner().moveAllToReady();
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+	while(!q.empty()) {
+		Block *block= q.getTail();
+		THEKERNEL.getMotionControl().issueMove(*block);
+		uint32_t current_tick= 0;
+		bool r= true;
+		while(r) {
+			++current_tick;
+			r= THEKERNEL.getMotionControl().issueTicks(current_tick);
+		}
+		overrun= std::max(overrun, (int32_t)(current_tick - block->total_move_ticks));
+		q.releaseTail();
+	}
+	return overrun;
+}
+
+TEST_CASE( "Speed override", "[override]" ) {
+	GCodeProcessor& gp= THEKERNEL.getGCodeProcessor();
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	const Actuator& xact= mc.getActuator('X');
+	const Actuator& yact= mc.getActuator('Y');
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+	GCodeProcessor::GCodes_t gcodes;
+	bool ok= gp.parse("G92 X0 Y0 G1 X100 Y50 F6000 G1 X0 Y0", gcodes);
+	REQUIRE(ok);
+	for(auto i : gcodes) {
+		THEDISPATCHER.dispatch(i);
+	}
+	THEKERNEL.getPlanner().moveAllToReady();
+
+	// change the speed a quarter of the way through the first block when it is at full speed
+	Block *block= q.getTail();
+	mc.issueMove(*block);
+	uint32_t current_tick= 0;
+	while(current_tick < block->total_move_ticks / 4) {
+		REQUIRE(mc.issueTicks(++current_tick));
+	}
+	float full_rate= xact.getStepRate();
+	THEDISPATCHER.dispatch('M', 220, 'S', 50.0F, 0);
+
+	// the executing block slows down to half speed without going over its acceleration, then slows down to its planned
+	// exit speed at the end, staying on the line
+	float last_rate= full_rate, mid_rate= full_rate, peak= 0;
+	int32_t off_line= 0;
+	while(mc.issueTicks(++current_tick)) {
+		float rate= xact.getStepRate();
+		peak= std::max(peak, fabsf(rate - last_rate) * STEP_TICKER_FREQUENCY);
+		if(current_tick == block->total_move_ticks * 3 / 4) mid_rate= rate;
+		last_rate= rate;
+		off_line= std::max(off_line, abs((int32_t)(yact.getCurrentPositionInSteps() * 2 - xact.getCurrentPositionInSteps())));
+	}
+	REQUIRE(off_line <= 2);
+	float accel= block->acceleration * block->steps_event_count / block->millimeters;
+	INFO("full rate " << full_rate << " then " << mid_rate << " peak acceleration " << peak << " of " << accel);
+	REQUIRE(mid_rate == Approx(full_rate / 2).epsilon(0.01F));
+	REQUIRE(peak <= accel * 1.01F);
+	REQUIRE(last_rate < full_rate / 10);
+	uint32_t slowest_ticks= block->total_move_ticks / 4 + block->total_move_ticks * 3 / 2;
+	REQUIRE(current_tick > block->total_move_ticks);
+	REQUIRE(current_tick < slowest_ticks);
+	REQUIRE(xact.getCurrentPositionInmm() == 100);
+	REQUIRE(yact.getCurrentPositionInmm() == 50);
+	q.releaseTail();
+
+	// the next block was planned at the old speed before the override changed, it runs at the new one
+	block= q.getTail();
+	REQUIRE(block != nullptr);
+	REQUIRE(block->nominal_speed == 100);
+	mc.issueMove(*block);
+	current_tick= 0;
+	while(mc.issueTicks(++current_tick)) {
+		if(current_tick == block->total_move_ticks / 2) mid_rate= xact.getStepRate();
+	}
+	REQUIRE(mid_rate == Approx(full_rate / 2).epsilon(0.01F));
+	REQUIRE(current_tick > block->total_move_ticks * 3 / 2);
+	REQUIRE(xact.getCurrentPositionInSteps() == 0);
+	REQUIRE(yact.getCurrentPositionInSteps() == 0);
+	q.releaseTail();
+	REQUIRE(q.empty());
+
+	THEDISPATCHER.dispatch('M', 220, 'S', 100.0F, 0);
+}
+
+TEST_CASE( "Step generator accuracy", "[stepper]" ) {
+	GCodeProcessor& gp= THEKERNEL.getGCodeProcessor();
+	MotionControl& mc= THEKERNEL.getMotionControl();
+
+	// both the float and the fixed point (make FIXED_POINT=1) step generators must end up in exactly the same place
+	SECTION("XYZE with accelerations and uneven axis ratios") {
+		GCodeProcessor::GCodes_t gcodes;
+		bool ok= gp.parse("G92 X0 Y0 Z0 E0 G1 X13.37 Y2.01 Z0.3 E0.5 F9000 G1 X-20.11 Y31.7 E1.23 F1200 G1 X0.01 Y0.03 Z1.7 E1.24 G1 X150 Y-7.3 E9.87 F18000 G1 X0 Y0 Z0 E0 F300", gcodes);
+		REQUIRE(ok);
+		for(auto i : gcodes) {
+			THEDISPATCHER.dispatch(i);
+		}
+
+		int32_t overrun= stepAllBlocks();
+		INFO("worst overrun in ticks: " << overrun);
+#ifdef STEP_FIXED_POINT
+		// no accumulated rounding errors so it should finish on time
+		REQUIRE(overrun <= 2);
+#else
+		REQUIRE(overrun <= 20);
+#endif
+
+		REQUIRE(mc.getActuator('X').getCurrentPositionInSteps() == 0);
+		REQUIRE(mc.getActuator('Y').getCurrentPositionInSteps() == 0);
+		REQUIRE(mc.getActuator('Z').getCurrentPositionInSteps() == 0);
+		REQUIRE(mc.getActuator('E').getCurrentPositionInSteps() == 0);
+		REQUIRE(THEKERNEL.getPlanner().getQueue().empty());
+	}
+
+	SECTION("S curve acceleration") {
+		const Actuator& xact= mc.getActuator('X');
+		int32_t steps_at[2];
+		for (int j = 0; j < 2; ++j) {
+			GCodeProcessor::GCodes_t gcodes;
+			bool ok= gp.parse(j == 0 ? "M204 S2000 J0 G92 X0 G1 X100 F6000" : "M204 S2000 J1 G92 X0 G1 X100 F6000", gcodes);
+			REQUIRE(ok);
+			for(auto i : gcodes) {
+				THEDISPATCHER.dispatch(i);
+			}
+			THEKERNEL.getPlanner().moveAllToReady();
+			Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+			Block *block= q.getTail();
+			REQUIRE(block->s_curve == (j == 1));
+			uint32_t quarter= block->accelerate_until / 4;
+			mc.issueMove(*block);
+			uint32_t current_tick= 0;
+			// the biggest change in rate from one tick to the next in steps/sec², not counting the first tick which starts at
+			// the entry rate, or the snap to the plateau rate at the end of the acceleration which takes out any rounding
+			float last_rate= 0, peak= 0;
+			while(mc.issueTicks(++current_tick)) {
+				if(current_tick == quarter) steps_at[j]= xact.getCurrentPositionInSteps();
+				float rate= xact.getStepRate();
+				if(current_tick > 1 && current_tick != block->accelerate_until) peak= std::max(peak, fabsf(rate - last_rate) * STEP_TICKER_FREQUENCY);
+				last_rate= rate;
+			}
+			INFO("S curve: " << j << " ticks: " << current_tick << " planned: " << block->total_move_ticks);
+			REQUIRE(current_tick <= block->total_move_ticks + 2);
+			// neither goes over the acceleration, and the S curve gets up to it at the middle of each ramp
+			float peak_mms= peak / xact.getStepsPermm();
+			INFO("peak acceleration: " << peak_mms);
+			REQUIRE(peak_mms <= 2000 * 1.01F);
+			REQUIRE(peak_mms >= 2000 * 0.95F);
+			q.releaseTail();
+			REQUIRE(xact.getCurrentPositionInSteps() == 10000);
+		}
+
+		// the S curve starts accelerating gently so it covers less distance early in the ramp, at 1/4 of the ramp it has
+		// gone 5u⁴/2 - 3u⁵ + u⁶ = 29/4096 against u²/2 = 128/4096 for the trapezoid, its ramp is 15/8 times as long at 8/15
+		// of the acceleration so that is 15/8 * 29/128 = 435/1024 of the steps
+		INFO("steps at 1/4 of the ramp, trapezoid: " << steps_at[0] << " S curve: " << steps_at[1]);
+		REQUIRE(steps_at[1] < steps_at[0]);
+		REQUIRE(steps_at[1] == Approx(steps_at[0] * 435.0F / 1024.0F).epsilon(0.2F));
+
+		THEDISPATCHER.dispatch('M', 204, 'J', 0.0F, 0);
+	}
+
+	SECTION("skipping idle ticks steps the same") {
+		const Actuator& xact= mc.getActuator('X');
+		const Actuator& yact= mc.getActuator('Y');
+		const char *moves= "G92 X0 Y0 E0 G1 X20 Y7.3 E1.1 F1200 G1 X-3 Y2 F600 G1 X0 Y0 E0 F3000";
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+		// where X and Y are every tick, then the same moves are run again skipping the idle ticks as the event scheduled
+		// step timer does, and they must be in the same place at each tick that is issued and at the end of the ones skipped
+		std::vector<std::pair<int32_t, int32_t>> trace;
+		uint32_t issued= 0, ticks= 0;
+		int32_t worst= 0;
+		auto check= [&]() {
+			size_t i= std::min((size_t)ticks, trace.size()) - 1;
+			worst= std::max(worst, std::abs((int32_t)xact.getCurrentPositionInSteps() - trace[i].first));
+			worst= std::max(worst, std::abs((int32_t)yact.getCurrentPositionInSteps() - trace[i].second));
+		};
+		for (int j = 0; j < 2; ++j) {
+			GCodeProcessor::GCodes_t gcodes;
+			REQUIRE(gp.parse(moves, gcodes));
+			for(auto i : gcodes) {
+				THEDISPATCHER.dispatch(i);
+			}
+			THEKERNEL.getPlanner().moveAllToReady();
+			while(!q.empty()) {
+				mc.issueMove(*q.getTail());
+				uint32_t current_tick= 0;
+				while(true) {
+					bool r= mc.issueTicks(++current_tick);
+					if(j == 0) {
+						trace.emplace_back(xact.getCurrentPositionInSteps(), yact.getCurrentPositionInSteps());
+						if(!r) break;
+						continue;
+					}
+					++issued;
+					++ticks;
+					check();
+					if(!r) break;
+					uint32_t n= mc.getIdleTicks(current_tick);
+					mc.skipTicks(n);
+					current_tick += n;
+					ticks += n;
+					check();
+				}
+				q.releaseTail();
+			}
+			REQUIRE(xact.getCurrentPositionInSteps() == 0);
+			REQUIRE(yact.getCurrentPositionInSteps() == 0);
+		}
+		INFO("issued " << issued << " of " << ticks << " ticks, stepping every tick took " << trace.size());
+		REQUIRE(issued < trace.size() / 4);
+#ifdef STEP_FIXED_POINT
+		// the ramp is summed exactly over the skipped ticks so it steps on exactly the same ticks
+		REQUIRE(worst == 0);
+		REQUIRE(ticks == trace.size());
+#else
+		// the float rounding is not quite the same when the ramp is summed over the skipped ticks
+		REQUIRE(worst <= 1);
+		REQUIRE(ticks == Approx(trace.size()).epsilon(0.001));
+#endif
+	}
+
+#ifdef STEP_BRESENHAM
+	SECTION("Bresenham followers") {
+		const Actuator& xact= mc.getActuator('X');
+		const Actuator& yact= mc.getActuator('Y');
+		THEDISPATCHER.dispatch('G', 92, 'X', 0.0F, 'Y', 0.0F, 0);
+		THEDISPATCHER.dispatch('G', 1, 'X', 10.0F, 'Y', 3.7F, 'F', 300.0F, 0);
+		THEKERNEL.getPlanner().moveAllToReady();
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+		Block *block= q.getTail();
+		REQUIRE(block != nullptr);
+		float ratio= (float)block->steps_to_move[mc.getAxisActuator('Y')] / block->steps_to_move[mc.getAxisActuator('X')];
+		mc.issueMove(*block);
+		uint32_t current_tick= 0;
+		int32_t lastx= xact.getCurrentPositionInSteps(), lasty= yact.getCurrentPositionInSteps();
+		float worst= 0;
+		int between= 0;
+		while(mc.issueTicks(++current_tick)) {
+			int32_t x= xact.getCurrentPositionInSteps(), y= yact.getCurrentPositionInSteps();
+			worst= std::max(worst, fabsf(y - x * ratio));
+			// at this rate the followers are stepped at 8 places between the steps of X, so Y does not always step with X
+			if(y != lasty && x == lastx) ++between;
+			lastx= x;
+			lasty= y;
+		}
+		q.releaseTail();
+		INFO("worst Y error " << worst << " steps, Y steps between X steps " << between);
+		REQUIRE(worst <= 1);
+		REQUIRE(between > 0);
+		REQUIRE(xact.getCurrentPositionInSteps() == 1000);
+		REQUIRE(yact.getCurrentPositionInSteps() == 370);
+	}
+#endif
+}
+
+TEST_CASE( "Feed hold", "[hold]" ) {
+	GCodeProcessor& gp= THEKERNEL.getGCodeProcessor();
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	const Actuator& xact= mc.getActuator('X');
+	const Actuator& yact= mc.getActuator('Y');
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+	GCodeProcessor::GCodes_t gcodes;
+	bool ok= gp.parse("G92 X0 Y0 G1 X100 Y50 F6000 G1 X0 Y0", gcodes);
+	REQUIRE(ok);
+	for(auto i : gcodes) {
+		THEDISPATCHER.dispatch(i);
+	}
+	THEKERNEL.getPlanner().moveAllToReady();
+
+	// hold half way through the first block when it is at full speed
+	Block *block= q.getTail();
+	mc.issueMove(*block);
+	uint32_t current_tick= 0;
+	while(current_tick < block->total_move_ticks / 2) {
+		REQUIRE(mc.issueTicks(++current_tick));
+	}
+	int32_t x_at_hold= xact.getCurrentPositionInSteps();
+	mc.feedHold();
+
+	// it slows down to a stop, taking about as long as it took to get up to speed
+	uint32_t hold_ticks= 0;
+	int32_t first_steps= 0, last_steps= 0;
+	while(mc.issueTicks(++current_tick)) {
+		++hold_ticks;
+		REQUIRE_FALSE(mc.resume()); // not stopped yet
+		if(hold_ticks == 1000) first_steps= xact.getCurrentPositionInSteps() - x_at_hold;
+	}
+	last_steps= xact.getCurrentPositionInSteps();
+	INFO("hold took " << hold_ticks << " ticks, accelerate took " << block->accelerate_until);
+	REQUIRE(mc.isHolding());
+	REQUIRE(hold_ticks > block->accelerate_until / 2);
+	REQUIRE(hold_ticks < block->accelerate_until * 2);
+	REQUIRE(first_steps > 0);
+	REQUIRE(xact.getCurrentPositionInmm() < 100);
+	// still on the line
+	REQUIRE(fabsf(yact.getCurrentPositionInmm() * 2 - xact.getCurrentPositionInmm()) < 0.1F);
+
+	// the rest of the block starts from rest
+	REQUIRE(mc.resume());
+	REQUIRE_FALSE(mc.isHolding());
+	REQUIRE(q.getTail() == block);
+	REQUIRE(block->entry_speed == 0);
+	REQUIRE(block->millimeters < 100);
+	current_tick= 0;
+	while(mc.issueTicks(++current_tick)) ;
+	REQUIRE(xact.getCurrentPositionInSteps() == last_steps + block->steps_to_move[mc.getAxisActuator('X')]);
+	REQUIRE(xact.getCurrentPositionInmm() == 100);
+	REQUIRE(yact.getCurrentPositionInmm() == 50);
+	q.releaseTail();
+
+	stepAllBlocks();
+	REQUIRE(xact.getCurrentPositionInSteps() == 0);
+	REQUIRE(yact.getCurrentPositionInSteps() == 0);
+	REQUIRE(q.empty());
+}
+
+TEST_CASE( "Feed hold while idle", "[hold]" ) {
+	GCodeProcessor& gp= THEKERNEL.getGCodeProcessor();
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	const Actuator& xact= mc.getActuator('X');
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+	// a hold sent with nothing moving is dropped when run is sent
+	mc.feedHold();
+	mc.cancelHold();
+
+	GCodeProcessor::GCodes_t gcodes;
+	bool ok= gp.parse("G92 X0 Y0 G1 X100 Y50 F6000", gcodes);
+	REQUIRE(ok);
+	for(auto i : gcodes) {
+		THEDISPATCHER.dispatch(i);
+	}
+	THEKERNEL.getPlanner().moveAllToReady();
+
+	// so the move runs to the end without holding
+	Block *block= q.getTail();
+	mc.issueMove(*block);
+	uint32_t current_tick= 0;
+	while(mc.issueTicks(++current_tick)) ;
+	REQUIRE_FALSE(mc.isHolding());
+	REQUIRE(xact.getCurrentPositionInmm() == 100);
+	q.releaseTail();
+	REQUIRE(q.empty());
+}
+
+TEST_CASE( "Feed hold past the end of a block", "[hold]" ) {
+	GCodeProcessor& gp= THEKERNEL.getGCodeProcessor();
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	const Actuator& xact= mc.getActuator('X');
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+	GCodeProcessor::GCodes_t gcodes;
+	bool ok= gp.parse("G92 X0 G1 X10 F6000 G1 X20", gcodes);
+	REQUIRE(ok);
+	for(auto i : gcodes) {
+		THEDISPATCHER.dispatch(i);
+	}
+	THEKERNEL.getPlanner().moveAllToReady();
+
+	// hold near the end of the first block, it joins the second at full speed so the hold can not stop before it ends
+	Block *block= q.getTail();
+	REQUIRE(block->exit_speed > 0);
+	float max_change= block->acceleration * xact.getStepsPermm() / STEP_TICKER_FREQUENCY;
+	mc.issueMove(*block);
+	uint32_t current_tick= 0;
+	while(current_tick < block->total_move_ticks * 9 / 10) {
+		REQUIRE(mc.issueTicks(++current_tick));
+	}
+	mc.feedHold();
+
+	// the hold carries on slowing down in the next block from where it got to, with no jump in speed between them
+	float last_rate= xact.getStepRate(), worst= 0;
+	// ticks to the end of the block or to where the hold stops it, keeping the biggest change in the X rate between ticks
+	auto tickOn= [&](uint32_t& current_tick) {
+		bool more;
+		do {
+			more= mc.issueTicks(++current_tick);
+			worst= std::max(worst, fabsf(xact.getStepRate() - last_rate));
+			last_rate= xact.getStepRate();
+		} while(more);
+	};
+	tickOn(current_tick);
+	REQUIRE_FALSE(mc.isHolding());
+	REQUIRE(xact.getCurrentPositionInmm() == 10);
+	q.releaseTail();
+	block= q.getTail();
+	REQUIRE(block != nullptr);
+	mc.issueMove(*block);
+	current_tick= 0;
+	tickOn(current_tick);
+	INFO("worst change in rate " << worst << " steps/sec a tick, the acceleration is " << max_change);
+	REQUIRE(mc.isHolding());
+	REQUIRE(worst <= max_change * 1.01F);
+	REQUIRE(xact.getCurrentPositionInmm() > 10);
+	REQUIRE(xact.getCurrentPositionInmm() < 20);
+
+	// then the rest of the second block starts from rest
+	REQUIRE(mc.resume());
+	REQUIRE(q.getTail() == block);
+	REQUIRE(block->entry_speed == 0);
+	current_tick= 0;
+	REQUIRE(mc.issueTicks(++current_tick));
+	REQUIRE(xact.getStepRate() <= max_change * 1.01F);
+	while(mc.issueTicks(++current_tick)) ;
+	REQUIRE(xact.getCurrentPositionInmm() == 20);
+	q.releaseTail();
+	REQUIRE(q.empty());
+
+	// a hold that stopped on the last step of a block resumes with the next block from rest
+	gcodes.clear();
+	ok= gp.parse("G1 X30 G1 X40", gcodes);
+	REQUIRE(ok);
+	for(auto i : gcodes) {
+		THEDISPATCHER.dispatch(i);
+	}
+	THEKERNEL.getPlanner().moveAllToReady();
+	block= q.getTail();
+	Block *next= &q[q.next(q.getTailIndex())];
+	REQUIRE(next->entry_speed > 0);
+	mc.issueMove(*block);
+	current_tick= 0;
+	while(mc.issueTicks(++current_tick)) ;
+	uint32_t none[MAX_AXES]= {0};
+	REQUIRE_FALSE(THEKERNEL.getPlanner().replanFromRest(*block, none, mc.getActuators().size()));
+	REQUIRE(next->entry_speed == 0);
+	REQUIRE(next->accelerate_until > 0);
+	q.releaseTail();
+	stepAllBlocks();
+	REQUIRE(xact.getCurrentPositionInmm() == 40);
+	REQUIRE(q.empty());
+}
+
+TEST_CASE( "Step chunks", "[chunks]" ) {
+	GCodeProcessor& gp= THEKERNEL.getGCodeProcessor();
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+	size_t n_axis= mc.getActuators().size();
+	auto dispatch= [&](const char *moves) {
+		GCodeProcessor::GCodes_t gcodes;
+		REQUIRE(gp.parse(moves, gcodes));
+		for(auto i : gcodes) {
+			THEDISPATCHER.dispatch(i);
+		}
+		THEKERNEL.getPlanner().moveAllToReady();
+	};
+
+	StepProducer producer;
+	// the ticks each actuator steps on as the chunks are played, and which way
+	std::vector<std::vector<std::pair<uint64_t, bool>>> played(n_axis);
+	std::vector<uint32_t> pulses(n_axis, 0);
+	auto play= [&](uint32_t ticks) {
+		for (uint32_t k = 0; k < ticks; ++k) {
+			if(producer.tick()) {
+				for (size_t i = 0; i < n_axis; ++i) {
+					StepperPins& pins= producer.getPins(i);
+					if(pins.steps == pulses[i]) continue;
+					pulses[i]= pins.steps;
+					played[i].emplace_back(producer.getClock(), pins.dir);
+				}
+			}
+			producer.unstep();
+		}
+	};
+
+	SECTION("the steps played are the steps made") {
+		const char *moves= "G92 X0 Y0 Z0 E0 G1 X20 Y7.3 Z0.2 E1.1 F1200 G1 X-3 Y2 E0.9 F600 G1 X0 Y0 Z0 E0 F3000";
+
+		// the ticks each actuator steps on when the step generator is run every tick in the step ticker ISR
+		std::vector<std::vector<std::pair<uint64_t, bool>>> made(n_axis);
+		std::vector<int32_t> last(n_axis, 0);
+		uint64_t t= 0;
+		dispatch(moves);
+		while(!q.empty()) {
+			mc.issueMove(*q.getTail());
+			uint32_t current_tick= 0;
+			bool r;
+			do {
+				r= mc.issueTicks(++current_tick);
+				++t;
+				for (size_t i = 0; i < n_axis; ++i) {
+					int32_t p= mc.getActuators()[i].getCurrentPositionInSteps();
+					if(p == last[i]) continue;
+					made[i].emplace_back(t, p > last[i]);
+					last[i]= p;
+				}
+			} while(r);
+			q.releaseTail();
+		}
+
+		// the same moves made into chunks ahead of the ticker then played back
+		dispatch(moves);
+		while(producer.fill()) {
+			play(1000);
+		}
+		play(STEP_CHUNK_AHEAD);
+		REQUIRE(q.empty());
+
+		// it starts a little ahead of the ticker, then every step is played within MAX_STEP_ERROR of the tick it was made on
+		REQUIRE(played[0].size() > 0);
+		uint64_t offset= played[0][0].first - made[0][0].first;
+		REQUIRE(offset == STEP_CHUNK_START);
+		uint32_t total= 0;
+		for (size_t i = 0; i < n_axis; ++i) {
+			INFO("actuator " << i);
+			REQUIRE(played[i].size() == made[i].size());
+			int64_t worst= 0;
+			size_t wrong_way= 0;
+			for (size_t j = 0; j < made[i].size(); ++j) {
+				int64_t e= (int64_t)(played[i][j].first - offset - made[i][j].first);
+				worst= std::max(worst, e < 0 ? -e : e);
+				if(played[i][j].second != made[i][j].second) ++wrong_way;
+			}
+			REQUIRE(worst <= MAX_STEP_ERROR);
+			REQUIRE(wrong_way == 0);
+			REQUIRE(mc.getActuators()[i].getCurrentPositionInSteps() == 0);
+			total += made[i].size();
+		}
+
+		// and most of the steps are in long chunks, the Bresenham followers step on the ticks the dominant axis does so
+		// their steps are not as evenly spaced
+		INFO(producer.getStepCount() << " steps in " << producer.getChunkCount() << " chunks");
+		REQUIRE(producer.getStepCount() == total);
+		uint32_t chunks= producer.getChunkCount();
+#ifdef STEP_BRESENHAM
+		REQUIRE(chunks < total / 5);
+#else
+		REQUIRE(chunks < total / 10);
+#endif
+	}
+
+	SECTION("every step is played even when an actuator steps more than once on a tick") {
+		// the pins log each step and which way it went, not just where the actuator ended up
+		StepperPins pins;
+		bool dirs[MAX_STEPS_PER_TICK];
+		pins.setDir(true);
+		pins.setStep(true);
+		pins.setStep(false);
+		pins.setDir(false);
+		pins.setStep(true);
+		REQUIRE(pins.takeSteps(dirs) == 2);
+		REQUIRE(dirs[0]);
+		REQUIRE_FALSE(dirs[1]);
+		REQUIRE(pins.takeSteps(dirs) == 0);
+
+		// pressure advance steps the extruder on top of the block and pulls it back at the end
+		const Actuator& eact= mc.getActuator('E');
+		THEDISPATCHER.dispatch('M', 900, 'K', 0.05F, 0);
+		std::vector<uint32_t> made(n_axis);
+		for (size_t i = 0; i < n_axis; ++i) made[i]= mc.getActuators()[i].getPins().steps;
+		dispatch("G92 X0 Y0 Z0 E0 G1 X20 Y7.3 E1.1 F3000 G1 X0 Y0 E0.5 G1 X10 E3");
+		while(producer.fill()) {
+			play(1000);
+		}
+		play(STEP_CHUNK_AHEAD);
+		THEDISPATCHER.dispatch('M', 900, 'K', 0.0F, 0);
+		REQUIRE(q.empty());
+		REQUIRE(eact.getCurrentPositionInmm() == 3);
+
+		uint32_t total= 0;
+		for (size_t i = 0; i < n_axis; ++i) {
+			INFO("actuator " << i);
+			const Actuator& a= mc.getActuators()[i];
+			uint32_t n= a.getPins().steps - made[i];
+			int32_t net= 0;
+			for (auto& p : played[i]) net += p.second ? 1 : -1;
+			REQUIRE(played[i].size() == n);
+			REQUIRE(net == (int32_t)a.getCurrentPositionInSteps());
+			total += n;
+		}
+		REQUIRE(producer.getStepCount() == total);
+	}
+
+	SECTION("feed hold and resume") {
+		const Actuator& xact= mc.getActuator('X');
+		dispatch("G92 X0 Y0 G1 X100 Y50 F6000 G1 X0 Y0");
+		for (int i = 0; i < 50; ++i) {
+			producer.fill();
+			play(1000);
+		}
+		mc.feedHold();
+		// it only starts to slow down once the producer gets to it, then it waits to be resumed
+		int n= 0;
+		while(!producer.isHeld()) {
+			REQUIRE_FALSE(producer.resume());
+			producer.fill();
+			play(1000);
+			REQUIRE(++n < 1000);
+		}
+		play(STEP_CHUNK_AHEAD);
+		int32_t x_at_hold= xact.getCurrentPositionInSteps();
+		REQUIRE(x_at_hold > 0);
+		REQUIRE(xact.getCurrentPositionInmm() < 100);
+		REQUIRE(pulses[0] == (uint32_t)x_at_hold);
+
+		REQUIRE(producer.resume());
+		REQUIRE_FALSE(producer.isHeld());
+		// the rest of the queue was replanned from the stop
+		THEKERNEL.getPlanner().moveAllToReady();
+		while(producer.fill()) {
+			play(1000);
+		}
+		play(STEP_CHUNK_AHEAD);
+		REQUIRE(q.empty());
+		REQUIRE(xact.getCurrentPositionInSteps() == 0);
+		REQUIRE(pulses[0] == (uint32_t)(xact.getStepsPermm() * 200));
+	}
+
+	SECTION("cleared by the producer task") {
+		dispatch("G92 X0 Y0 G1 X100 Y50 F6000 G1 X0 Y0");
+		for (int i = 0; i < 10; ++i) {
+			producer.fill();
+			play(1000);
+		}
+		REQUIRE_FALSE(producer.isIdle());
+		// kill asks for it, the task that fills it clears it instead
+		producer.requestClear();
+		REQUIRE(producer.isClearRequested());
+		REQUIRE_FALSE(producer.isIdle());
+		if(producer.isClearRequested()) producer.clear();
+		REQUIRE_FALSE(producer.isClearRequested());
+		REQUIRE(producer.isIdle());
+		REQUIRE(producer.getClock() == 0);
+		REQUIRE_FALSE(producer.tick());
+		THEKERNEL.getPlanner().purge();
+		mc.resetAxisPositions();
+		REQUIRE(q.empty());
+	}
+
+	SECTION("rendered into BSRR words") {
+		StepRenderer renderer(producer);
+		struct { uint8_t port; uint16_t step, dir; bool step_inverted, dir_inverted; } pins[]= {
+			{ 0, 1 << 0, 1 << 1, false, false }, { 0, 1 << 2, 1 << 3, true, false },
+			{ 1, 1 << 5, 1 << 6, false, false }, { 2, 1 << 7, 1 << 8, false, true }
+		};
+		REQUIRE(n_axis <= 4);
+		for (size_t i = 0; i < n_axis; ++i) {
+			renderer.assign(i, pins[i].port, pins[i].step, pins[i].step_inverted, pins[i].port, pins[i].dir, pins[i].dir_inverted);
+		}
+
+		// the port pins as the DMA writes the words to the BSRR, decoded back into the steps of each actuator
+		uint16_t levels[STEP_RENDER_PORTS]= {0};
+		for (size_t i = 0; i < n_axis; ++i) {
+			if(pins[i].step_inverted) levels[pins[i].port] |= pins[i].step;
+			if(pins[i].dir_inverted) levels[pins[i].port] |= pins[i].dir;
+		}
+		auto isOn= [&](uint8_t port, uint16_t pin, bool inverted) { return ((levels[port] & pin) != 0) != inverted; };
+		std::vector<int32_t> positions(n_axis, 0);
+		uint32_t stuck= 0, dir_with_step= 0;
+		int half= 0;
+		auto render= [&]() {
+			renderer.render(half);
+			for (size_t w = half * StepRenderer::BUFFER_SIZE / 2; w < (half + 1) * StepRenderer::BUFFER_SIZE / 2; ++w) {
+				bool step[4], dir[4];
+				for (size_t i = 0; i < n_axis; ++i) {
+					step[i]= isOn(pins[i].port, pins[i].step, pins[i].step_inverted);
+					dir[i]= isOn(pins[i].port, pins[i].dir, pins[i].dir_inverted);
+				}
+				for (size_t p = 0; p < STEP_RENDER_PORTS; ++p) {
+					uint32_t bsrr= renderer.getBuffer(p)[w];
+					// set wins if a pin is both set and reset
+					levels[p] &= ~(bsrr >> 16);
+					levels[p] |= bsrr & 0xFFFF;
+				}
+				for (size_t i = 0; i < n_axis; ++i) {
+					bool s= isOn(pins[i].port, pins[i].step, pins[i].step_inverted);
+					bool d= isOn(pins[i].port, pins[i].dir, pins[i].dir_inverted);
+					if(s && !step[i]) {
+						positions[i] += d ? 1 : -1;
+						if(d != dir[i]) ++dir_with_step;
+					}
+					// each step pulse is over by the end of its tick
+					if(s && w % STEP_RENDER_SLOTS == STEP_RENDER_SLOTS - 1) ++stuck;
+				}
+			}
+			half ^= 1;
+		};
+
+		dispatch("G92 X0 Y0 Z0 E0 G1 X20 Y7.3 Z0.2 E1.1 F1200 G1 X-3 Y2 E0.9 F600 G1 X5 Y-1 Z0 E2 F3000");
+		while(producer.fill()) {
+			render();
+		}
+		for (int i = 0; i < STEP_CHUNK_AHEAD / STEP_RENDER_TICKS; ++i) {
+			render();
+		}
+		REQUIRE(q.empty());
+		for (size_t i = 0; i < n_axis; ++i) {
+			INFO("actuator " << i);
+			REQUIRE(positions[i] == (int32_t)mc.getActuators()[i].getCurrentPositionInSteps());
+		}
+		REQUIRE(positions[mc.getAxisActuator('Y')] < 0);
+		REQUIRE(stuck == 0);
+		REQUIRE(dir_with_step == 0);
+	}
+}
+
+TEST_CASE( "Pressure advance", "[advance]" ) {
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	const Actuator& xact= mc.getActuator('X');
+	const Actuator& eact= mc.getActuator('E');
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+	THEDISPATCHER.dispatch('G', 92, 'X', 0.0F, 'E', 0.0F, 0);
+	THEDISPATCHER.dispatch('M', 900, 'K', 0.05F, 0);
+	REQUIRE(eact.getPressureAdvance() == Approx(0.05F));
+	THEDISPATCHER.dispatch('G', 1, 'X', 50.0F, 'E', 5.0F, 'F', 3000.0F, 0);
+	THEKERNEL.getPlanner().moveAllToReady();
+
+	// the extruder runs ahead of the position the block puts it at by K times its speed
+	Block *block= q.getTail();
+	REQUIRE(block != nullptr);
+	float e_ratio= (float)block->steps_to_move[mc.getAxisActuator('E')] / block->steps_to_move[mc.getAxisActuator('X')];
+	float e_speed= block->nominal_speed * 5.0F / 50.0F * eact.getStepsPermm(); // steps/sec
+	uint32_t dir_sets= eact.getPins().dir_sets;
+	mc.issueMove(*block);
+	uint32_t current_tick= 0;
+	float max_lead= 0, lead_at_cruise= 0;
+	while(mc.issueTicks(++current_tick)) {
+		float lead= eact.getCurrentPositionInSteps() - xact.getCurrentPositionInSteps() * e_ratio;
+		max_lead= std::max(max_lead, lead);
+		if(current_tick == (block->accelerate_until + block->decelerate_after) / 2) lead_at_cruise= lead;
+	}
+	q.releaseTail();
+	INFO("max lead " << max_lead << " steps, expected " << 0.05F * e_speed);
+	REQUIRE(block->decelerate_after > block->accelerate_until);
+	REQUIRE(lead_at_cruise == Approx(0.05F * e_speed).epsilon(0.02));
+	REQUIRE(max_lead < 0.05F * e_speed + 2);
+	// it had to pull back at the end
+	REQUIRE(eact.getPins().dir_sets > dir_sets + 1);
+	// and it ends up in the right place
+	REQUIRE(eact.getCurrentPositionInmm() == 5);
+	REQUIRE(xact.getCurrentPositionInmm() == 50);
+
+	// not used when there is no extrusion, or with K0
+	THEDISPATCHER.dispatch('G', 1, 'X', 0.0F, 'E', 4.0F, 0);
+	THEDISPATCHER.dispatch('M', 900, 'K', 0.0F, 0);
+	THEDISPATCHER.dispatch('G', 1, 'X', 50.0F, 'E', 9.0F, 0);
+	dir_sets= eact.getPins().dir_sets;
+	stepAllBlocks();
+	REQUIRE(eact.getPins().dir_sets == dir_sets + 2);
+	REQUIRE(eact.getCurrentPositionInmm() == 9);
+	REQUIRE(q.empty());
+}
+
+TEST_CASE( "Delta kinematics", "[delta]" ) {
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+	THEDISPATCHER.dispatch('M', 669, 'K', 3.0F, 0);
+	THEDISPATCHER.dispatch('M', 665, 'L', 250.0F, 'R', 124.0F, 'S', 100.0F, 0);
+	THEDISPATCHER.dispatch('M', 92, 'X', 80.0F, 'Y', 80.0F, 'Z', 80.0F, 0);
+	THEDISPATCHER.dispatch('M', 203, 'Z', 300.0F, 0);
+	THEDISPATCHER.dispatch('M', 204, 'Z', 0.0F, 0);
+	THEDISPATCHER.dispatch('G', 92, 'X', 0.0F, 'Y', 0.0F, 'Z', 0.0F, 0);
+	const Kinematics& k= mc.getKinematics();
+	REQUIRE_FALSE(k.isLinear());
+
+	// the carriages are all the same height above the center
+	float home= sqrtf(250.0F * 250.0F - 124.0F * 124.0F);
+	for(char c : {'X', 'Y', 'Z'}) {
+		REQUIRE(mc.getActuator(c).getCurrentPositionInmm() == Approx(home).epsilon(0.0001));
+	}
+
+	SECTION("forward kinematics is the inverse of the inverse kinematics") {
+		float points[][3]{ {0, 0, 0}, {50, 20, 5}, {-80, 30, 100}, {10, -90, -3} };
+		for(auto& p : points) {
+			float a[3], c[3];
+			k.cartesianToActuator(p, a);
+			k.actuatorToCartesian(a, c);
+			for (int i = 0; i < 3; ++i) {
+				REQUIRE(c[i] == Approx(p[i]).epsilon(0.0001));
+			}
+		}
+	}
+
+	SECTION("moves out of reach of the arms are not planned") {
+		// the X tower is 124mm from the center, so 150mm the other side of it is more than the 250mm arm away
+		std::string r= THEDISPATCHER.dispatch('G', 1, 'X', 150.0F, 'F', 6000.0F, 0);
+		REQUIRE(r.find("out of reach") != std::string::npos);
+		float p[3]{150, 0, 0};
+		REQUIRE_FALSE(k.isReachable(p));
+		// an arc from and to reachable points that goes out of reach on the way
+		r= THEDISPATCHER.dispatch('G', 2, 'X', 0.0F, 'Y', 0.0F, 'I', 100.0F, 'J', 0.0F, 0);
+		REQUIRE(r.find("out of reach") != std::string::npos);
+		THEKERNEL.getPlanner().moveAllToReady();
+		REQUIRE(q.empty());
+
+		// and it carries on from where it was
+		THEDISPATCHER.dispatch('G', 1, 'X', 100.0F, 'F', 6000.0F, 0);
+		THEKERNEL.getPlanner().moveAllToReady();
+		REQUIRE_FALSE(q.empty());
+		stepAllBlocks();
+		float a[3], c[3];
+		for (int i = 0; i < 3; ++i) a[i]= mc.getActuators()[i].getCurrentPositionInmm();
+		k.actuatorToCartesian(a, c);
+		REQUIRE(c[0] == Approx(100).epsilon(0.0005));
+		REQUIRE(fabsf(c[1]) < 0.02F);
+	}
+
+	SECTION("lines are segmented and stay straight") {
+		THEDISPATCHER.dispatch('G', 1, 'X', 50.0F, 'Y', 20.0F, 'Z', 5.0F, 'F', 6000.0F, 0);
+		// 54mm at 100mm/sec is 0.54 seconds, at 100 segments a second
+		THEKERNEL.getPlanner().moveAllToReady();
+		REQUIRE(q.size() == 55);
+
+		float max_error= 0;
+		while(!q.empty()) {
+			Block *block= q.getTail();
+			mc.issueMove(*block);
+			uint32_t current_tick= 0;
+			while(mc.issueTicks(++current_tick)) ;
+			q.releaseTail();
+
+			// the effector has to be on the line between each segment
+			float a[3], c[3];
+			for (int i = 0; i < 3; ++i) a[i]= mc.getActuators()[i].getCurrentPositionInmm();
+			k.actuatorToCartesian(a, c);
+			float t= c[0] / 50.0F;
+			max_error= std::max({max_error, fabsf(c[1] - 20.0F * t), fabsf(c[2] - 5.0F * t)});
+		}
+		INFO("max error " << max_error);
+		REQUIRE(max_error < 0.02F);
+
+		float a[3], c[3];
+		for (int i = 0; i < 3; ++i) a[i]= mc.getActuators()[i].getCurrentPositionInmm();
+		k.actuatorToCartesian(a, c);
+		REQUIRE(c[0] == Approx(50).epsilon(0.0005));
+		REQUIRE(c[1] == Approx(20).epsilon(0.0005));
+		REQUIRE(fabsf(c[2] - 5) < 0.02F);
+	}
+
+	// back to the defaults
+	THEDISPATCHER.dispatch('M', 669, 'K', 0.0F, 0);
+	THEDISPATCHER.dispatch('M', 92, 'X', 100.0F, 'Y', 100.0F, 'Z', 400.0F, 0);
+	THEDISPATCHER.dispatch('M', 203, 'Z', 30.0F, 0);
+	THEDISPATCHER.dispatch('M', 204, 'Z', 100.0F, 0);
+	THEDISPATCHER.dispatch('G', 92, 0);
+	REQUIRE(mc.getKinematics().isLinear());
+}
+
+TEST_CASE( "Input shaper", "[shaper]" ) {
+	SECTION("ZV follows half the commanded position now and half of it delayed") {
+		InputShaper is;
+		REQUIRE(is.configure(InputShaper::ZV, 50, 0)); // 20ms period, second impulse 1000 ticks later
+		std::vector<int32_t> commanded;
+		int32_t p= 0;
+		for (uint32_t t = 1; t < 5000; ++t) {
+			// 300 steps forward then 100 back
+			if(t % 10 == 0 && t <= 3000) {
+				bool dir= t <= 3000 - 1000;
+				is.push(dir);
+				p += dir ? 1 : -1;
+			}
+			commanded.push_back(p);
+			int s= is.tick();
+			if(s != 0) is.moved(s);
+			float shaped= 0.5F * p + 0.5F * (t > 1000 ? commanded[t - 1 - 1000] : 0);
+			// allowing for the tick it takes to change direction
+			REQUIRE(fabsf(is.getPosition() - shaped) <= 1);
+		}
+		REQUIRE(is.isIdle());
+		REQUIRE(p == 100);
+	}
+
+	SECTION("the queue holds the steps at the max step rate over the delay") {
+		// 80 steps/mm at 300mm/s is 24000 steps/sec, ZVD at 20Hz holds them back for 50ms
+		InputShaper is;
+		REQUIRE(is.configure(InputShaper::ZVD, 20, 0, 24000));
+		REQUIRE(is.getQueueSize() >= 1200);
+		REQUIRE(is.fits(24000));
+		REQUIRE_FALSE(is.fits(48000));
+		// a step every tick for a whole second is too many, and the shaper it had is kept
+		REQUIRE_FALSE(is.configure(InputShaper::ZVD, 1, 0, STEP_TICKER_FREQUENCY));
+		REQUIRE(is.getType() == InputShaper::ZVD);
+		REQUIRE(is.getFrequency() == 20);
+
+		// none of the steps at that rate are shaped early
+		std::vector<int32_t> commanded;
+		int32_t p= 0;
+		uint32_t delay= 5000; // ticks
+		float worst= 0;
+		for (uint32_t t = 1; t < 20000; ++t) {
+			if(t % 4 == 0 && t <= 10000) {
+				is.push(true);
+				++p;
+			}
+			commanded.push_back(p);
+			int s= is.tick();
+			if(s != 0) is.moved(s);
+			float shaped= 0.25F * p + 0.5F * (t > delay / 2 ? commanded[t - 1 - delay / 2] : 0) + 0.25F * (t > delay ? commanded[t - 1 - delay] : 0);
+			worst= std::max(worst, fabsf(is.getPosition() - shaped));
+		}
+		REQUIRE(worst <= 1);
+		REQUIRE(is.getPosition() == 2500);
+
+		// the actuators size it from their max speed, and say when a new max speed no longer fits
+		THEKERNEL.initialize();
+		const Actuator& xact= THEKERNEL.getMotionControl().getActuator('X');
+		THEDISPATCHER.dispatch('M', 203, 'X', 300.0F, 0);
+		THEDISPATCHER.dispatch('M', 593, 'X', 2.0F, 'F', 20.0F, 'D', 0.0F, 0);
+		REQUIRE(xact.getInputShaper() != nullptr);
+		REQUIRE(xact.getInputShaper()->getQueueSize() >= xact.getStepsPermm() * 300 / 20);
+		REQUIRE(xact.checkInputShaper());
+		THEDISPATCHER.dispatch('M', 203, 'X', 1000.0F, 0);
+		REQUIRE_FALSE(xact.checkInputShaper());
+		THEDISPATCHER.dispatch('M', 203, 'X', 500.0F, 0);
+		THEDISPATCHER.dispatch('M', 593, 'X', 0.0F, 0);
+		REQUIRE(xact.checkInputShaper());
+	}
+
+	SECTION("shaped moves end in the right place and ring less") {
+		MotionControl& mc= THEKERNEL.getMotionControl();
+		THEKERNEL.initialize();
+		const Actuator& xact= mc.getActuator('X');
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+		// X position in steps every tick of a move from 0 to 20mm and back to 10mm, until the shaper has finished
+		auto run= [&](float type) {
+			THEDISPATCHER.dispatch('M', 593, 'X', type, 'F', 33.0F, 'D', 0.0F, 0);
+			THEDISPATCHER.dispatch('G', 92, 'X', 0.0F, 0);
+			THEDISPATCHER.dispatch('G', 1, 'X', 20.0F, 'F', 6000.0F, 0);
+			THEDISPATCHER.dispatch('G', 1, 'X', 10.0F, 0);
+			THEKERNEL.getPlanner().moveAllToReady();
+			std::vector<int32_t> x;
+			while(!q.empty()) {
+				Block *block= q.getTail();
+				mc.issueMove(*block);
+				uint32_t current_tick= 0;
+				while(mc.issueTicks(++current_tick)) x.push_back(xact.getCurrentPositionInSteps());
+				x.push_back(xact.getCurrentPositionInSteps());
+				q.releaseTail();
+			}
+			while(mc.issueShaperTicks()) x.push_back(xact.getCurrentPositionInSteps());
+			x.push_back(xact.getCurrentPositionInSteps());
+			return x;
+		};
+
+		// how much an undamped 33Hz spring driven by the position is still ringing after the move
+		auto ringing= [](const std::vector<int32_t>& x) {
+			const float w= 2 * (float)M_PI * 33, dt= 1 / STEP_TICKER_FREQUENCY;
+			float pos= 0, vel= 0, r= 0;
+			for (size_t t = 0; t < x.size() + 10000; ++t) {
+				float p= x[std::min(t, x.size() - 1)];
+				vel += -w * w * (pos - p) * dt;
+				pos += vel * dt;
+				if(t >= x.size()) r= std::max(r, fabsf(pos - p));
+			}
+			return r;
+		};
+
+		std::vector<int32_t> plain= run(0);
+		REQUIRE(mc.getActuator('X').getInputShaper() == nullptr);
+		for(int type : {InputShaper::ZV, InputShaper::ZVD, InputShaper::MZV}) {
+			std::vector<int32_t> shaped= run(type);
+			REQUIRE(mc.getActuator('X').getInputShaper() != nullptr);
+			REQUIRE_FALSE(mc.isShaping());
+			REQUIRE(shaped.back() == 1000);
+			REQUIRE(xact.getCurrentPositionInmm() == 10);
+			// it takes longer by the length of the shaper
+			REQUIRE(shaped.size() > plain.size());
+			INFO("type " << type << " ringing " << ringing(shaped) << " steps, without " << ringing(plain) << " steps");
+			REQUIRE(ringing(shaped) < ringing(plain) / 5);
+		}
+
+		run(0);
+		REQUIRE(mc.getActuator('X').getInputShaper() == nullptr);
+	}
+}
+
+// writes the X speed of the same move with and without a ZVD shaper to shaper-profile.csv, ./run [shaper-profile]
+TEST_CASE( "Input shaper profile", "[.][shaper-profile]" ) {
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	const Actuator& xact= mc.getActuator('X');
+
+	// X position every tick
+	auto run= [&](float type) {
+		THEDISPATCHER.dispatch('M', 593, 'X', type, 'F', 40.0F, 'D', 0.1F, 0);
+		THEDISPATCHER.dispatch('G', 92, 'X', 0.0F, 0);
+		THEDISPATCHER.dispatch('G', 1, 'X', 30.0F, 'F', 12000.0F, 0);
+		THEKERNEL.getPlanner().moveAllToReady();
+		Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+		std::vector<int32_t> x;
+		while(!q.empty()) {
+			mc.issueMove(*q.getTail());
+			uint32_t current_tick= 0;
+			while(mc.issueTicks(++current_tick)) x.push_back(xact.getCurrentPositionInSteps());
+			q.releaseTail();
+		}
+		while(mc.issueShaperTicks()) x.push_back(xact.getCurrentPositionInSteps());
+		x.push_back(xact.getCurrentPositionInSteps());
+		return x;
+	};
+	std::vector<int32_t> commanded= run(0);
+	std::vector<int32_t> shaped= run(InputShaper::ZVD);
+	run(0);
+
+	// speed in mm/sec over each millisecond
+	const size_t ms= STEP_TICKER_FREQUENCY / 1000;
+	std::ofstream o("shaper-profile.csv");
+	o << "ms,commanded,shaped\n";
+	for (size_t t = ms; t < shaped.size(); t += ms) {
+		auto at= [&](const std::vector<int32_t>& x, size_t i) { return x[std::min(i, x.size() - 1)]; };
+		o << t / ms << "," << (at(commanded, t) - at(commanded, t - ms)) / xact.getStepsPermm() * 1000
+		  << "," << (at(shaped, t) - at(shaped, t - ms)) / xact.getStepsPermm() * 1000 << "\n";
+	}
+	REQUIRE(o.good());
+}
+
+TEST_CASE( "Arcs", "[arc]" ) {
+	GCodeProcessor& gp= THEKERNEL.getGCodeProcessor();
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	const Actuator& xact= mc.getActuator('X');
+	const Actuator& yact= mc.getActuator('Y');
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+	// plans the arc then steps it, checking every segment end is on the circle, returns the lowest Y reached
+	auto runArc= [&](const char *gcode, float cx, float cy, float r, size_t segments) {
+		GCodeProcessor::GCodes_t gcodes;
+		bool ok= gp.parse(gcode, gcodes);
+		REQUIRE(ok);
+		for(auto i : gcodes) {
+			THEDISPATCHER.dispatch(i);
+		}
+		INFO("arc: " << gcode);
+		REQUIRE(q.size() == segments);
+		THEKERNEL.getPlanner().moveAllToReady();
+		float miny= 1000;
+		while(!q.empty()) {
+			mc.issueMove(*q.getTail());
+			uint32_t current_tick= 0;
+			while(mc.issueTicks(++current_tick)) ;
+			q.releaseTail();
+			float x= xact.getCurrentPositionInmm(), y= yact.getCurrentPositionInmm();
+			// within the chord tolerance plus a step either way
+			REQUIRE(hypotf(x - cx, y - cy) == Approx(r).epsilon(0.02F / r));
+			miny= std::min(miny, y);
+		}
+		return miny;
+	};
+
+	SECTION("full circle with I J") {
+		// 2*acos(1 - 0.01/10) per segment with the default tolerance
+		runArc("G92 X0 Y0 G17 G2 X0 Y0 I10 J0 F6000", 10, 0, 10, 71);
+		REQUIRE(xact.getCurrentPositionInSteps() == 0);
+		REQUIRE(yact.getCurrentPositionInSteps() == 0);
+	}
+
+	SECTION("clockwise quarter circle with R") {
+		float miny= runArc("G92 X0 Y0 G2 X10 Y10 R10 F6000", 10, 0, 10, 18);
+		REQUIRE(miny >= 0);
+		REQUIRE(xact.getCurrentPositionInSteps() == 1000);
+		REQUIRE(yact.getCurrentPositionInSteps() == 1000);
+	}
+
+	SECTION("counter clockwise three quarter circle, coarser tolerance") {
+		THEDISPATCHER.dispatch('M', 205, 'Q', 0.1F, 0);
+		float miny= runArc("G92 X0 Y0 G3 X10 Y10 I10 J0 F6000", 10, 0, 10, 17);
+		REQUIRE(miny == Approx(-10).epsilon(0.01F));
+		REQUIRE(xact.getCurrentPositionInSteps() == 1000);
+		REQUIRE(yact.getCurrentPositionInSteps() == 1000);
+		THEDISPATCHER.dispatch('M', 205, 'Q', 0.01F, 0);
+	}
+}
+
+TEST_CASE( "Corner blending", "[blend]" ) {
+	GCodeProcessor& gp= THEKERNEL.getGCodeProcessor();
+	MotionControl& mc= THEKERNEL.getMotionControl();
+	THEKERNEL.initialize();
+	const Actuator& xact= mc.getActuator('X');
+	const Actuator& yact= mc.getActuator('Y');
+	Planner::Queue_t& q= THEKERNEL.getPlanner().getQueue();
+
+	// runs a square, returns the total planned time in ticks, in G64 checks every block ends within the tolerance of the square
+	auto runSquare= [&](const char *mode, float tolerance) {
+		GCodeProcessor::GCodes_t gcodes;
+		std::string gcode= std::string("G92 X0 Y0 ") + mode + " G1 X10 Y0 F6000 G1 X10 Y10 G1 X0 Y10 G1 X0 Y0 G61";
+		bool ok= gp.parse(gcode.c_str(), gcodes);
+		REQUIRE(ok);
+		for(auto i : gcodes) {
+			THEDISPATCHER.dispatch(i);
+		}
+		INFO("Mode: " << mode);
+		THEKERNEL.getPlanner().moveAllToReady();
+		uint32_t ticks= 0;
+		while(!q.empty()) {
+			Block *block= q.getTail();
+			ticks += block->total_move_ticks;
+			mc.issueMove(*block);
+			uint32_t current_tick= 0;
+			while(mc.issueTicks(++current_tick)) ;
+			q.releaseTail();
+			float x= xact.getCurrentPositionInmm(), y= yact.getCurrentPositionInmm();
+			float dist= std::min(std::min(fabsf(x), fabsf(x - 10)), std::min(fabsf(y), fabsf(y - 10)));
+			REQUIRE(dist <= tolerance + 0.01F);
+		}
+		REQUIRE(xact.getCurrentPositionInSteps() == 0);
+		REQUIRE(yact.getCurrentPositionInSteps() == 0);
+		return ticks;
+	};
+
+	uint32_t exact_ticks= runSquare("G61", 0);
+	uint32_t blend_ticks= runSquare("G64 P0.05", 0.05F);
+	INFO("G61 ticks: " << exact_ticks << " G64 ticks: " << blend_ticks);
+	REQUIRE(blend_ticks < exact_ticks);
+}
+
 TEST_CASE( "Stream Output", "[streamoutput]" ) {
 	SECTION("basic output") {
 		// dispatch gcode to MotionControl and Planner
@@ -591,3 +1950,70 @@ TEST_CASE( "RingBuffer", "[ringbuffer]" ) {
 	}
 }
 
+
+#include "BlockQueue.h"
+TEST_CASE( "BlockQueue", "[blockqueue]" ) {
+
+	SECTION("Lookahead, ready and release") {
+		BlockQueue<8> q;
+		REQUIRE(q.empty());
+		REQUIRE_FALSE(q.full());
+		REQUIRE(q.getTail() == nullptr);
+		REQUIRE(q.capacity() == 7);
+
+		for (uint32_t i = 1; i <= 7; ++i) {
+			REQUIRE_FALSE(q.full());
+			q.getHead().id= i;
+			q.pushHead();
+		}
+		REQUIRE(q.full());
+		REQUIRE(q.size() == 7);
+		REQUIRE(q.lookaheadSize() == 7);
+		REQUIRE(q.readySize() == 0);
+		// nothing can be executed until it is made ready
+		REQUIRE(q.getTail() == nullptr);
+
+		// make the oldest three ready
+		size_t i= q.getReadyIndex();
+		for (int j = 0; j < 3; ++j) i= q.next(i);
+		q.setReadyIndex(i);
+		REQUIRE(q.lookaheadSize() == 4);
+		REQUIRE(q.readySize() == 3);
+
+		// the block is used in place and stays in the queue until released
+		Block *b= q.getTail();
+		REQUIRE(b != nullptr);
+		REQUIRE(b->id == 1);
+		REQUIRE(q.getTail() == b);
+		REQUIRE(q.full());
+		q.releaseTail();
+		REQUIRE_FALSE(q.full());
+		REQUIRE(q.readySize() == 2);
+
+		// taking back the ready blocks leaves the executing block and the next one
+		REQUIRE(q.reclaim(2) == q.getReadyIndex());
+		REQUIRE(q.readySize() == 2);
+		q.readyAll();
+		REQUIRE(q.readySize() == 6);
+		size_t r= q.reclaim(2);
+		REQUIRE(r == q.next(q.next(q.getTailIndex())));
+		REQUIRE(q.readySize() == 2);
+		REQUIRE(q.lookaheadSize() == 4);
+		REQUIRE(q.reclaim(2) == r);
+
+		// wrap around
+		q.getHead().id= 8;
+		q.pushHead();
+		REQUIRE(q.full());
+		q.readyAll();
+		REQUIRE(q.lookaheadSize() == 0);
+		for (uint32_t id = 2; id <= 8; ++id) {
+			b= q.getTail();
+			REQUIRE(b != nullptr);
+			REQUIRE(b->id == id);
+			q.releaseTail();
+		}
+		REQUIRE(q.getTail() == nullptr);
+		REQUIRE(q.empty());
+	}
+}